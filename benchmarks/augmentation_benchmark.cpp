@@ -0,0 +1,86 @@
+/*
+ * Compares MSCKF::augmentState against the dense J * P * J^T augmentation it
+ * replaced, for accuracy and cost over a range of camera state counts.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "benchmark_utils.h"
+
+namespace msckf_mono {
+
+  // The previous augmentation: builds the full (N+6) x N Jacobian and
+  // multiplies it through the whole covariance.
+  template <typename _S>
+    MatrixX<_S> dense_augment(const MatrixX<_S>& P, const Camera<_S>& camera,
+                              const imuState<_S>& imu_state)
+    {
+      const size_t n = P.cols();
+      MatrixX<_S> J = MatrixX<_S>::Zero(6, n);
+      J.template block<3, 3>(0, 0) = camera.q_CI.toRotationMatrix();
+      J.template block<3, 3>(3, 0) =
+        vectorToSkewSymmetric(imu_state.q_IG.inverse() * camera.p_C_I);
+      J.template block<3, 3>(3, 12) = Matrix3<_S>::Identity();
+
+      MatrixX<_S> tempMat = MatrixX<_S>::Identity(n + 6, n);
+      tempMat.block(n, 0, 6, n) = J;
+
+      MatrixX<_S> P_aug = tempMat * P * tempMat.transpose();
+      return (P_aug + P_aug.transpose()) / 2.0;
+    }
+
+  template <typename _S>
+    void run(const char* name)
+    {
+      std::vector<imuReading<_S>> readings = make_readings<_S>(10, 200.0);
+      MSCKF<_S> msckf = make_filter<_S>(MatrixExponential);
+
+      for (size_t num_states = 10; num_states <= 100; num_states += 10) {
+        // Grow the filter to num_states camera states, with some propagation in
+        // between so the camera blocks are not identical
+        while (msckf.getNumCamStates() < num_states) {
+          for (auto reading : readings) {
+            msckf.propagate(reading);
+          }
+          msckf.augmentState(msckf.getNumCamStates(), 0.0);
+        }
+
+        const MatrixX<_S> P = msckf.getCovar();
+        const int reps = std::max(20, static_cast<int>(20000 / num_states));
+
+        MatrixX<_S> P_dense;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < reps; ++i) {
+          P_dense = dense_augment<_S>(P, msckf.getCamera(), msckf.getImuState());
+        }
+        auto end = std::chrono::steady_clock::now();
+        double dense_us = std::chrono::duration<double, std::micro>(end - start).count() / reps;
+
+        // augmentState grows the filter, so time it on copies
+        std::vector<MSCKF<_S>, Eigen::aligned_allocator<MSCKF<_S>>> copies(reps, msckf);
+        start = std::chrono::steady_clock::now();
+        for (auto& copy : copies) {
+          copy.augmentState(num_states, 0.0);
+        }
+        end = std::chrono::steady_clock::now();
+        double inplace_us = std::chrono::duration<double, std::micro>(end - start).count() / reps;
+
+        _S rel_err = (copies.front().getCovar() - P_dense).norm() / P_dense.norm();
+        std::printf("%-6s %3zu cam states | dense %9.2f us | in place %7.2f us"
+                    " | speedup %6.1fx | rel covar diff %.3e\n",
+                    name, num_states, dense_us, inplace_us, dense_us / inplace_us,
+                    static_cast<double>(rel_err));
+      }
+    }
+
+} // End namespace
+
+int main(int argc, char** argv)
+{
+  msckf_mono::run<float>("float");
+  msckf_mono::run<double>("double");
+  return 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * Filter and IMU data setup shared by the micro-benchmarks.
+ */
+
+#ifndef MSCKF_BENCHMARK_UTILS_H_
+#define MSCKF_BENCHMARK_UTILS_H_
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include <msckf_mono/msckf.h>
+
+namespace msckf_mono {
+
+  template <typename _S>
+    MSCKF<_S> make_filter(TransitionMethod method)
+    {
+      Camera<_S> camera;
+      camera.f_u = camera.f_v = 450;
+      camera.c_u = 376;
+      camera.c_v = 240;
+      camera.q_CI = Quaternion<_S>(0.71, -0.01, 0.01, 0.70).normalized();
+      camera.p_C_I << -0.02, 0.06, 0.01;
+
+      noiseParams<_S> noise_params;
+      noise_params.u_var_prime = noise_params.v_var_prime = 1e-5;
+      Eigen::Matrix<_S, 12, 1> Q_imu_vars;
+      Q_imu_vars << 1e-4, 1e-4, 1e-4,
+                    3.6733e-5, 3.6733e-5, 3.6733e-5,
+                    1e-2, 1e-2, 1e-2,
+                    7e-2, 7e-2, 7e-2;
+      noise_params.Q_imu = Q_imu_vars.asDiagonal();
+      noise_params.initial_imu_covar = Eigen::Matrix<_S, 15, 15>::Identity() * 1e-2;
+
+      MSCKFParams<_S> msckf_params;
+      msckf_params.max_gn_cost_norm = 1;
+      msckf_params.min_rcond = 3e-12;
+      msckf_params.translation_threshold = 0.05;
+      msckf_params.redundancy_angle_thresh = 0.005;
+      msckf_params.redundancy_distance_thresh = 0.05;
+      msckf_params.min_track_length = 3;
+      msckf_params.max_track_length = 50;
+      msckf_params.max_cam_states = 30;
+      msckf_params.transition_method = method;
+
+      imuState<_S> imu_state;
+      imu_state.p_I_G.setZero();
+      imu_state.v_I_G << 0.5, -0.2, 0.1;
+      imu_state.b_g << 0.001, -0.002, 0.003;
+      imu_state.b_a << 0.02, 0.01, -0.03;
+      imu_state.g << 0.0, 0.0, -9.81;
+      imu_state.q_IG = Quaternion<_S>(0.9, 0.1, -0.3, 0.2).normalized();
+
+      MSCKF<_S> msckf;
+      msckf.initialize(camera, noise_params, msckf_params, imu_state);
+      return msckf;
+    }
+
+  template <typename _S>
+    std::vector<imuReading<_S>> make_readings(size_t n, double rate)
+    {
+      std::mt19937 gen(7);
+      std::normal_distribution<double> noise(0.0, 1.0);
+      std::vector<imuReading<_S>> readings(n);
+      for (size_t i = 0; i < n; ++i) {
+        double t = i / rate;
+        readings[i].omega << 0.8 * std::sin(t), 0.5 * std::cos(2 * t), 1.5 + 0.05 * noise(gen);
+        readings[i].a << 0.3 * noise(gen), 0.3 * noise(gen), 9.81 + 0.3 * noise(gen);
+        readings[i].dT = 1.0 / rate;
+      }
+      return readings;
+    }
+
+} // End namespace
+
+#endif /* MSCKF_BENCHMARK_UTILS_H_ */
@@ -0,0 +1,97 @@
+/*
+ * Times CornerDetector::detect_features with box and integral image Shi-Tomasi
+ * scoring, for full image and grid cell detection, on a real image. Takes
+ * the image path as its argument (e.g. euroc/MH03.png or an EuRoC frame).
+ * Grid cell detection is timed with every cell empty and with one cell in
+ * five empty, as when most features are still tracked.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include <opencv2/imgcodecs.hpp>
+
+#include <msckf_mono/corner_detector.h>
+
+using namespace corner_detector;
+
+namespace {
+  // Mean detect_features time in ms, with the cells k % 5 != 0 occupied if
+  // mostly_tracked
+  double time_detection(const cv::Mat& image, DetectionMethod detection,
+                        ScoringMethod scoring, bool mostly_tracked, size_t& num_features)
+  {
+    CornerDetector detector;
+    detector.set_detection_method(detection, 1);
+    detector.set_scoring_method(scoring);
+
+    std::vector<cv::Point2f> features;
+    // Sets up the grid and the buffers
+    detector.detect_features(image, features);
+
+    const int n_rows = detector.get_n_rows();
+    const int n_cols = detector.get_n_cols();
+    const float grid_width = image.cols / n_cols + 1;
+    const float grid_height = image.rows / n_rows + 1;
+
+    const int reps = 50;
+    double total_ms = 0;
+    for (int i = 0; i < reps; i++)
+    {
+      if (mostly_tracked)
+      {
+        for (int k = 0; k < n_rows * n_cols; k++)
+        {
+          if (k % 5 != 0)
+            detector.set_grid_position(cv::Point2f((k % n_cols + 0.5f) * grid_width,
+                                                   (k / n_cols + 0.5f) * grid_height));
+        }
+      }
+      auto start = std::chrono::steady_clock::now();
+      detector.detect_features(image, features);
+      auto end = std::chrono::steady_clock::now();
+      total_ms += std::chrono::duration<double, std::milli>(end - start).count();
+    }
+    num_features = features.size();
+    return total_ms / reps;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    std::fprintf(stderr, "Usage: %s image\n", argv[0]);
+    return 1;
+  }
+  cv::Mat image = cv::imread(argv[1], cv::IMREAD_GRAYSCALE);
+  if (image.empty())
+  {
+    std::fprintf(stderr, "Could not read %s\n", argv[1]);
+    return 1;
+  }
+  // The SSE2 FAST detector loads rows in aligned 16 pixel blocks
+  image = image(cv::Rect(0, 0, image.cols & ~15, image.rows)).clone();
+
+  struct Case { const char* name; DetectionMethod detection; bool mostly_tracked; };
+  const Case cases[] = {
+    {"full image", FullImageDetection, false},
+    {"grid cells, all empty", GridCellDetection, false},
+    {"grid cells, 1 in 5 empty", GridCellDetection, true},
+  };
+
+  std::printf("%dx%d image\n", image.cols, image.rows);
+  for (const Case& c : cases)
+  {
+    size_t box_features, integral_features;
+    const double box_ms = time_detection(image, c.detection, BoxScoring, c.mostly_tracked,
+                                         box_features);
+    const double integral_ms = time_detection(image, c.detection, IntegralImageScoring,
+                                              c.mostly_tracked, integral_features);
+    std::printf("%-26s | box %8.3f ms | integral %8.3f ms | speedup %5.2fx | features %zu / %zu\n",
+                c.name, box_ms, integral_ms, box_ms / integral_ms,
+                box_features, integral_features);
+  }
+  return 0;
+}
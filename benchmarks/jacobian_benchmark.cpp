@@ -0,0 +1,138 @@
+/*
+ * Compares the per-observation camera state Jacobian of
+ * MSCKF::calcMeasJacobian, which reads the rotation and R_CG * g cached in
+ * each camera state and projects out the unobservable direction with a
+ * rank-1 update, against the form it replaced.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "benchmark_utils.h"
+
+namespace msckf_mono {
+
+  template <typename _S>
+    Matrix<_S, 2, 3> projection_jacobian(const Vector3<_S>& p_f_C)
+    {
+      Matrix<_S, 2, 3> J_i;
+      J_i << 1, 0, -p_f_C(0) / p_f_C(2), 0, 1, -p_f_C(1) / p_f_C(2);
+      return J_i / p_f_C(2);
+    }
+
+  // The previous Jacobian: converts q_CG three times and inverts u^T u.
+  template <typename _S>
+    Matrix<_S, 2, 6> reference_jacobian(const camState<_S>& cam, const Vector3<_S>& p_f_G,
+                                        const Vector3<_S>& g)
+    {
+      Vector3<_S> p_f_C = cam.q_CG.toRotationMatrix() * (p_f_G - cam.p_C_G);
+      Matrix<_S, 2, 3> J_i = projection_jacobian(p_f_C);
+
+      Matrix<_S, 2, 6> A;
+      A << J_i * vectorToSkewSymmetric(p_f_C),
+        -J_i * cam.q_CG.toRotationMatrix();
+
+      Matrix<_S, 6, 1> u = Matrix<_S, 6, 1>::Zero();
+      u.template head<3>() = cam.q_CG.toRotationMatrix() * g;
+      Vector3<_S> tmp = p_f_G - cam.p_C_G;
+      u.template tail<3>() = vectorToSkewSymmetric(tmp) * g;
+
+      return A - A * u * (u.transpose() * u).inverse() * u.transpose();
+    }
+
+  // As in calcMeasJacobian
+  template <typename _S>
+    Matrix<_S, 2, 6> cached_jacobian(const camState<_S>& cam, const Vector3<_S>& p_f_G,
+                                     const Vector3<_S>& g)
+    {
+      Vector3<_S> p_f_C = cam.R_CG * (p_f_G - cam.p_C_G);
+      Matrix<_S, 2, 3> J_i = projection_jacobian(p_f_C);
+
+      Matrix<_S, 2, 6> H_x;
+      H_x << J_i * vectorToSkewSymmetric(p_f_C),
+        -J_i * cam.R_CG;
+
+      Matrix<_S, 6, 1> u;
+      u.template head<3>() = cam.R_CG_g;
+      u.template tail<3>() = (p_f_G - cam.p_C_G).cross(g);
+      projectOutDirection(H_x, u);
+      return H_x;
+    }
+
+  template <typename _S>
+    void run(const char* name)
+    {
+      std::vector<imuReading<_S>> readings = make_readings<_S>(10, 200.0);
+      MSCKF<_S> msckf = make_filter<_S>(MatrixExponential);
+      while (msckf.getNumCamStates() < 30) {
+        for (auto reading : readings) {
+          msckf.propagate(reading);
+        }
+        msckf.augmentState(msckf.getNumCamStates(), 0.0);
+      }
+      const camStateVector<_S> cam_states = msckf.getCamStates();
+      const Vector3<_S> g = msckf.getImuState().g;
+
+      // Features 2 - 10 m in front of the first camera
+      std::mt19937 gen(5);
+      std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+      std::vector<Vector3<_S>> features(200);
+      const camState<_S>& cam0 = cam_states.front();
+      for (auto& p_f_G : features) {
+        Vector3<_S> p_f_C(uniform(gen), uniform(gen), 6.0 + 4.0 * uniform(gen));
+        p_f_G = cam0.R_CG.transpose() * p_f_C + cam0.p_C_G;
+      }
+
+      const int reps = 20;
+      const double num_jacobians = double(reps) * features.size() * cam_states.size();
+      _S checksum = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < reps; ++i) {
+        for (const auto& p_f_G : features) {
+          for (const auto& cam : cam_states) {
+            checksum += reference_jacobian(cam, p_f_G, g)(0, 0);
+          }
+        }
+      }
+      auto end = std::chrono::steady_clock::now();
+      double reference_ns =
+        std::chrono::duration<double, std::nano>(end - start).count() / num_jacobians;
+
+      start = std::chrono::steady_clock::now();
+      for (int i = 0; i < reps; ++i) {
+        for (const auto& p_f_G : features) {
+          for (const auto& cam : cam_states) {
+            checksum += cached_jacobian(cam, p_f_G, g)(0, 0);
+          }
+        }
+      }
+      end = std::chrono::steady_clock::now();
+      double cached_ns =
+        std::chrono::duration<double, std::nano>(end - start).count() / num_jacobians;
+
+      double max_err = 0;
+      for (const auto& p_f_G : features) {
+        for (const auto& cam : cam_states) {
+          Matrix<_S, 2, 6> H_ref = reference_jacobian(cam, p_f_G, g);
+          double err = (cached_jacobian(cam, p_f_G, g) - H_ref).norm() / H_ref.norm();
+          max_err = std::max(max_err, err);
+        }
+      }
+
+      std::printf("%-6s %zu cam states x %zu features | reference %6.1f ns | cached rank-1 %6.1f ns"
+                  " | speedup %5.2fx | max rel err %.2e (checksum %g)\n",
+                  name, cam_states.size(), features.size(), reference_ns, cached_ns,
+                  reference_ns / cached_ns, max_err, double(checksum));
+    }
+
+} // End namespace
+
+int main(int argc, char** argv)
+{
+  msckf_mono::run<float>("float");
+  msckf_mono::run<double>("double");
+  return 0;
+}
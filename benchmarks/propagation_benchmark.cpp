@@ -0,0 +1,63 @@
+/*
+ * Compares the matrix-exponential and closed-form IMU transition matrices
+ * used by MSCKF::propagate, for accuracy and per-sample cost.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "benchmark_utils.h"
+
+namespace msckf_mono {
+
+  template <typename _S>
+    double time_propagation(TransitionMethod method,
+                            const std::vector<imuReading<_S>>& readings)
+    {
+      MSCKF<_S> msckf = make_filter<_S>(method);
+      auto start = std::chrono::steady_clock::now();
+      for (auto reading : readings) {
+        msckf.propagate(reading);
+      }
+      auto end = std::chrono::steady_clock::now();
+      return std::chrono::duration<double, std::nano>(end - start).count() / readings.size();
+    }
+
+  template <typename _S>
+    void run(const char* name)
+    {
+      const double rates[] = {200.0, 1000.0};
+      for (double rate : rates) {
+        // One second of data for accuracy, then a longer run for timing
+        std::vector<imuReading<_S>> readings = make_readings<_S>(static_cast<size_t>(rate), rate);
+        MSCKF<_S> expm = make_filter<_S>(MatrixExponential);
+        MSCKF<_S> closed = make_filter<_S>(ClosedForm);
+        _S max_rel_err = 0;
+        for (auto reading : readings) {
+          expm.propagate(reading);
+          closed.propagate(reading);
+          Matrix<_S, 15, 15> P_expm = expm.getImuCovar();
+          Matrix<_S, 15, 15> P_closed = closed.getImuCovar();
+          max_rel_err = std::max(max_rel_err, (P_expm - P_closed).norm() / P_expm.norm());
+        }
+
+        std::vector<imuReading<_S>> timing_readings = make_readings<_S>(20000, rate);
+        double expm_ns = time_propagation<_S>(MatrixExponential, timing_readings);
+        double closed_ns = time_propagation<_S>(ClosedForm, timing_readings);
+
+        std::printf("%-6s %6.0f Hz | matrix exp %9.1f ns/sample | closed form %9.1f ns/sample"
+                    " | speedup %5.2fx | max rel covar diff %.3e\n",
+                    name, rate, expm_ns, closed_ns, expm_ns / closed_ns,
+                    static_cast<double>(max_rel_err));
+      }
+    }
+
+} // End namespace
+
+int main(int argc, char** argv)
+{
+  msckf_mono::run<float>("float");
+  msckf_mono::run<double>("double");
+  return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * Compares the Cholesky-solved covariance update used by
+ * MSCKF::measurementUpdate against the explicit-inverse Joseph form it
+ * replaced, for accuracy and cost at typical camera state counts.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "benchmark_utils.h"
+
+namespace msckf_mono {
+
+  // The previous update: K = P H^T S^-1 and the full Joseph form.
+  template <typename _S>
+    void joseph_update(MatrixX<_S>& P, const MatrixX<_S>& H, const VectorX<_S>& r,
+                       const _S& noise_var, VectorX<_S>& delta_x)
+    {
+      MatrixX<_S> R_n = noise_var * MatrixX<_S>::Identity(H.rows(), H.rows());
+      MatrixX<_S> temp = H * P * H.transpose() + R_n;
+      MatrixX<_S> K = (P * H.transpose()) * temp.inverse();
+      delta_x = K * r;
+
+      MatrixX<_S> tempMat = MatrixX<_S>::Identity(P.rows(), P.cols()) - K * H;
+      MatrixX<_S> P_corrected = tempMat * P * tempMat.transpose() + K * R_n * K.transpose();
+      P = (P_corrected + P_corrected.transpose()) / 2;
+    }
+
+  template <typename _S>
+    void run(const char* name)
+    {
+      std::vector<imuReading<_S>> readings = make_readings<_S>(10, 200.0);
+      MSCKF<_S> msckf = make_filter<_S>(MatrixExponential);
+      std::mt19937 gen(11);
+      std::normal_distribution<double> noise(0.0, 1.0);
+      const _S noise_var = 1e-5;
+
+      const size_t state_counts[] = {20, 30, 50};
+      for (size_t num_states : state_counts) {
+        while (msckf.getNumCamStates() < num_states) {
+          for (auto reading : readings) {
+            msckf.propagate(reading);
+          }
+          msckf.augmentState(msckf.getNumCamStates(), 0.0);
+        }
+
+        // Compressed measurement as measurementUpdate sees it: one row per
+        // camera state column, with zero IMU columns
+        // Without updates the camera states are exact functions of the IMU
+        // state and P has rank 15. Load the diagonal to get the full-rank P of
+        // a filter that has been running.
+        MatrixX<_S> P = msckf.getCovar();
+        P.diagonal().array() += 1e-4;
+        const int cols = P.cols();
+        const int rows = cols - 15;
+        MatrixX<_S> H = MatrixX<_S>::Zero(rows, cols);
+        VectorX<_S> r(rows);
+        for (int i = 0; i < rows; ++i) {
+          r(i) = 1e-3 * noise(gen);
+          for (int j = 15; j < cols; ++j) {
+            H(i, j) = noise(gen);
+          }
+        }
+
+        const int reps = 50;
+        MatrixX<_S> P_joseph;
+        VectorX<_S> dx_joseph;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < reps; ++i) {
+          P_joseph = P;
+          joseph_update<_S>(P_joseph, H, r, noise_var, dx_joseph);
+        }
+        auto end = std::chrono::steady_clock::now();
+        double joseph_us = std::chrono::duration<double, std::micro>(end - start).count() / reps;
+
+        MatrixX<_S> P_chol;
+        VectorX<_S> dx_chol(cols);
+        ScratchArena scratch;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < reps; ++i) {
+          P_chol = P;
+          scratch.reset();
+          choleskyKalmanUpdate(P_chol, H, r, noise_var, dx_chol, scratch);
+        }
+        end = std::chrono::steady_clock::now();
+        double chol_us = std::chrono::duration<double, std::micro>(end - start).count() / reps;
+
+        // Accuracy of both against the Joseph form in double precision
+        MatrixX<double> P_ref = P.template cast<double>();
+        VectorX<double> dx_ref;
+        joseph_update<double>(P_ref, H.template cast<double>(), r.template cast<double>(),
+                              noise_var, dx_ref);
+        auto P_err = [&](const MatrixX<_S>& P_x) {
+          return (P_x.template cast<double>() - P_ref).norm() / P_ref.norm();
+        };
+        auto dx_err = [&](const VectorX<_S>& dx) {
+          return (dx.template cast<double>() - dx_ref).norm() / dx_ref.norm();
+        };
+
+        std::printf("%-6s %3zu cam states | joseph %9.1f us | cholesky %9.1f us | speedup %5.2fx"
+                    " | rel covar err joseph %.2e cholesky %.2e | rel dx err joseph %.2e cholesky %.2e\n",
+                    name, num_states, joseph_us, chol_us, joseph_us / chol_us,
+                    P_err(P_joseph), P_err(P_chol), dx_err(dx_joseph), dx_err(dx_chol));
+      }
+    }
+
+} // End namespace
+
+int main(int argc, char** argv)
+{
+  msckf_mono::run<float>("float");
+  msckf_mono::run<double>("double");
+  return 0;
+}
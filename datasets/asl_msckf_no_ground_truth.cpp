@@ -352,6 +352,14 @@ int main(int argc, char** argv)
   msckf_params.min_track_length = min_tl;
   msckf_params.max_cam_states = max_cs;
 
+  int transition_method;
+  nh.param<int>("imu_transition_method", transition_method, 0); // 0: matrix exponential, 1: closed form
+  msckf_params.transition_method = transition_method == 1 ?
+    msckf_mono::ClosedForm : msckf_mono::MatrixExponential;
+  nh.param<int>("num_threads", msckf_params.num_threads, 1); // marginalization workers, needs OpenMP
+  nh.param<float>("triangulation_distance_thresh", msckf_params.triangulation_distance_thresh, 0.005);
+  nh.param<float>("triangulation_angle_thresh", msckf_params.triangulation_angle_thresh, 0.005);
+
   std::cout << "cam0->get_K()" << std::endl << cam0->get_K() << std::endl << std::endl;
   std::cout << "cam0->get_dist_coeffs()" << std::endl << cam0->get_dist_coeffs() << std::endl << std::endl;
   std::cout << "distortion_model" << std::endl << cam0->get_dist_model() << std::endl << std::endl;
@@ -368,6 +376,17 @@ int main(int argc, char** argv)
   nh.param<int>("n_grid_cols", n_grid_cols, 8);
   th.set_grid_size(n_grid_rows, n_grid_cols);
 
+  int detection_method, detection_threads;
+  nh.param<int>("corner_detection_method", detection_method, 0); // 0: full image, 1: empty grid cells only
+  nh.param<int>("detection_threads", detection_threads, 1); // grid cell workers, needs OpenMP
+  th.set_detection_method(detection_method == 1 ?
+    corner_detector::GridCellDetection : corner_detector::FullImageDetection, detection_threads);
+
+  int scoring_method;
+  nh.param<int>("corner_scoring_method", scoring_method, 0); // 0: per-corner box sums, 1: integral images
+  th.set_scoring_method(scoring_method == 1 ?
+    corner_detector::IntegralImageScoring : corner_detector::BoxScoring);
+
   int state_k = 0;
   msckf_mono::imuState<float> firstImuState;
   std::vector<std::pair<asl_dataset::timestamp, msckf_mono::imuReading<float>>> imu_reading_buffer;
@@ -680,4 +699,9 @@ int main(int argc, char** argv)
 
     sync->next();
   }
+
+  const size_t tri_hits = msckf.getTriangulationCacheHits();
+  const size_t tri_total = tri_hits + msckf.getTriangulationCacheMisses();
+  ROS_INFO_STREAM("Triangulation cache: " << tri_hits << " of " << tri_total << " triangulations reused ("
+                  << (tri_total ? 100.0 * tri_hits / tri_total : 0.0) << "% hit rate)");
 }
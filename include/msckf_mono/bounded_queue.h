@@ -0,0 +1,115 @@
+#ifndef MSCKF_MONO_BOUNDED_QUEUE_H_
+#define MSCKF_MONO_BOUNDED_QUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace msckf_mono {
+  // Fixed-capacity lock-free queue after D. Vyukov's bounded MPMC queue. Each
+  // cell carries a sequence number telling producers and consumers whether it
+  // is free or full for their current position, so a push or pop is a single
+  // compare-and-swap on the shared position in the common case.
+  //
+  // It is used as a single-producer single-consumer hand-off, but pops are
+  // safe from any thread. That lets the producer discard the oldest element
+  // to make room (see pushDropOldest) while the consumer keeps popping.
+  //
+  // T must be default constructible and move assignable.
+  template <typename T>
+    class BoundedQueue {
+      public:
+        // Capacity is rounded up to a power of two.
+        explicit BoundedQueue(size_t capacity)
+          : enqueue_pos_(0), dequeue_pos_(0) {
+          size_t size = 2;
+          while (size < capacity) size *= 2;
+          cells_.reset(new Cell[size]);
+          mask_ = size - 1;
+          for (size_t i = 0; i < size; i++) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+          }
+        }
+
+        BoundedQueue(const BoundedQueue&) = delete;
+        BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+        // Returns false, leaving value untouched, if the queue is full.
+        template <typename U>
+          bool tryPush(U&& value) {
+            size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+            Cell* cell;
+            for (;;) {
+              cell = &cells_[pos & mask_];
+              const size_t seq = cell->sequence.load(std::memory_order_acquire);
+              const std::ptrdiff_t dif = std::ptrdiff_t(seq) - std::ptrdiff_t(pos);
+              if (dif == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                  break;
+              } else if (dif < 0) {
+                return false;
+              } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+              }
+            }
+            cell->data = std::forward<U>(value);
+            cell->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+          }
+
+        // Pushes value, popping and discarding the oldest elements while the
+        // queue is full. Returns the number discarded.
+        template <typename U>
+          size_t pushDropOldest(U&& value) {
+            size_t num_dropped = 0;
+            T dropped;
+            while (!tryPush(std::forward<U>(value))) {
+              if (tryPop(dropped)) num_dropped++;
+            }
+            return num_dropped;
+          }
+
+        // Returns false if the queue is empty.
+        bool tryPop(T& value) {
+          size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+          Cell* cell;
+          for (;;) {
+            cell = &cells_[pos & mask_];
+            const size_t seq = cell->sequence.load(std::memory_order_acquire);
+            const std::ptrdiff_t dif = std::ptrdiff_t(seq) - std::ptrdiff_t(pos + 1);
+            if (dif == 0) {
+              if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+            } else if (dif < 0) {
+              return false;
+            } else {
+              pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+          }
+          value = std::move(cell->data);
+          cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+
+        size_t capacity() const { return mask_ + 1; }
+
+      private:
+        struct Cell {
+          std::atomic<size_t> sequence;
+          T data;
+        };
+
+        std::unique_ptr<Cell[]> cells_;
+        size_t mask_;
+        // Producer and consumer positions on separate cache lines. Padded
+        // rather than aligned so the queue needs no over-aligned allocation.
+        char pad0_[64];
+        std::atomic<size_t> enqueue_pos_;
+        char pad1_[64 - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t> dequeue_pos_;
+        char pad2_[64 - sizeof(std::atomic<size_t>)];
+    };
+}
+
+#endif
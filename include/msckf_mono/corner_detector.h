@@ -32,6 +32,17 @@ typedef std::vector<msckf_mono::Vector2<float>,
                     Eigen::aligned_allocator<msckf_mono::Vector2<float>>>
                       OutFeatureVector;
 
+// FullImageDetection runs FAST once over the whole image and then discards
+// corners in occupied grid cells. GridCellDetection runs it only on the
+// empty cells, in parallel when built with OpenMP.
+enum DetectionMethod { FullImageDetection, GridCellDetection };
+
+// BoxScoring sums the gradient products over each corner's box directly.
+// IntegralImageScoring builds a summed-area table of them, over the whole
+// image or only around the grid cells that have corners, so each corner's
+// score is four lookups per product.
+enum ScoringMethod { BoxScoring, IntegralImageScoring };
+
 class CornerDetector{
 public:
   CornerDetector(int n_rows=8, int n_cols=10, double detection_threshold=40.0);
@@ -39,19 +50,50 @@ public:
   void detect_features(const cv::Mat& image, std::vector<cv::Point2f>& features);
   void set_grid_position(const cv::Point2f& pos);
   void set_grid_size(int n_rows, int n_cols);
+  void set_detection_method(DetectionMethod method, int num_threads=1);
+  void set_scoring_method(ScoringMethod method);
 
   int get_n_rows(){return grid_n_rows_;}
   int get_n_cols(){return grid_n_cols_;}
 
+  // Summed-area table of (Ix^2, Iy^2, IxIy) over region of an image. The
+  // buffers only grow, so frames of the same size do not allocate; sum is a
+  // view of sum_buffer covering region.
+  struct GradientIntegral {
+    cv::Rect region;
+    cv::Size image_size;
+    cv::Mat sum;
+    cv::Mat image_f, dx, dy, products[3], merged, sum_buffer;
+  };
+
+  // Builds integral over region of image, reusing its buffers
+  void compute_gradient_integral(const cv::Mat& image, const cv::Rect& region,
+                                 GradientIntegral& integral);
+
   float shiTomasiScore(const cv::Mat& img, int u, int v);
+  // Same score from a table built by compute_gradient_integral. The box
+  // around (u, v) must lie inside its region.
+  float integralShiTomasiScore(const GradientIntegral& integral, int u, int v) const;
   int sub2ind(const cv::Point2f& sub);
 private:
+  // Fill score_table / feature_table with the best corner of each empty cell
+  void detect_full_image(const cv::Mat& image, std::vector<double>& score_table,
+                         std::vector<cv::Point2f>& feature_table);
+  void detect_grid_cells(const cv::Mat& image, std::vector<double>& score_table,
+                         std::vector<cv::Point2f>& feature_table);
+  float corner_score(const cv::Mat& image, const GradientIntegral& integral, int u, int v);
   void zero_occupancy_grid();
   std::vector<bool> occupancy_grid_;
   // Size of each grid rectangle in pixels
   int grid_n_rows_, grid_n_cols_, grid_width_, grid_height_;
   // Threshold for corner score
   double detection_threshold_;
+  DetectionMethod detection_method_;
+  int num_threads_;
+  ScoringMethod scoring_method_;
+  // IntegralImageScoring tables, one per detection thread
+  std::vector<GradientIntegral> gradient_integrals_;
+  cv::Mat dx_kernel_, dy_kernel_;
 }; // CornerDetector class
 
 class CornerTracker
@@ -117,6 +159,8 @@ class TrackHandler
     IdVector get_prev_ids(){return prev_feature_ids_;}
 
     void set_grid_size(int n_rows, int n_cols);
+    void set_detection_method(DetectionMethod method, int num_threads);
+    void set_scoring_method(ScoringMethod method);
     void set_ransac_threshold(double rt);
 
     cv::Mat get_track_image();
@@ -0,0 +1,138 @@
+#ifndef MSCKF_MONO_ID_INDEX_MAP_H_
+#define MSCKF_MONO_ID_INDEX_MAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace msckf_mono {
+  // Hash map from ids (feature ids, camera state ids) to indices, for the
+  // filter's lookup tables. Entries live in one flat array probed linearly,
+  // and erase shifts later entries of the probe run back instead of leaving
+  // tombstones, so inserting and erasing at a steady size never touches the
+  // heap. The array doubles when it would become more than half full;
+  // growths() counts those reallocations.
+  class IdIndexMap {
+    public:
+      static constexpr size_t npos = static_cast<size_t>(-1);
+
+      IdIndexMap() : size_(0), shift_(64), growths_(0) {}
+
+      // Makes room for n entries without growing.
+      void reserve(size_t n) {
+        size_t slots = kMinSlots;
+        while (slots < 2 * n) slots *= 2;
+        if (slots > entries_.size()) rehash(slots);
+      }
+
+      // Index stored for id, or npos.
+      size_t find(size_t id) const {
+        if (size_ == 0) return npos;
+        for (size_t i = home(id);; i = next(i)) {
+          const Entry& entry = entries_[i];
+          if (!entry.used) return npos;
+          if (entry.id == id) return entry.index;
+        }
+      }
+
+      bool contains(size_t id) const { return find(id) != npos; }
+
+      // Inserts id, or overwrites its index.
+      void set(size_t id, size_t index) {
+        if (!entries_.empty()) {
+          size_t i = home(id);
+          for (; entries_[i].used; i = next(i)) {
+            if (entries_[i].id == id) {
+              entries_[i].index = index;
+              return;
+            }
+          }
+          if (2 * (size_ + 1) <= entries_.size()) {
+            entries_[i] = {id, index, true};
+            size_++;
+            return;
+          }
+        }
+        rehash(entries_.empty() ? kMinSlots : 2 * entries_.size());
+        insertNew(id, index);
+      }
+
+      // Removes id if present.
+      void erase(size_t id) {
+        if (size_ == 0) return;
+        size_t hole = home(id);
+        for (;; hole = next(hole)) {
+          if (!entries_[hole].used) return;
+          if (entries_[hole].id == id) break;
+        }
+
+        // Move back every later entry of the run whose home is not
+        // cyclically in (hole, j], so lookups never stop at the hole early
+        for (size_t j = next(hole); entries_[j].used; j = next(j)) {
+          const size_t k = home(entries_[j].id);
+          const bool reachable = hole <= j ? (hole < k && k <= j) : (hole < k || k <= j);
+          if (!reachable) {
+            entries_[hole] = entries_[j];
+            hole = j;
+          }
+        }
+        entries_[hole].used = false;
+        size_--;
+      }
+
+      // Removes every entry and keeps the storage.
+      void clear() {
+        for (Entry& entry : entries_) entry.used = false;
+        size_ = 0;
+      }
+
+      size_t size() const { return size_; }
+
+      // Number of times the entry array was allocated since construction.
+      size_t growths() const { return growths_; }
+
+    private:
+      static constexpr size_t kMinSlots = 16;
+
+      struct Entry {
+        size_t id;
+        size_t index;
+        bool used;
+      };
+
+      // Fibonacci hashing: the top bits of id times 2^64 / phi
+      size_t home(size_t id) const {
+        return static_cast<size_t>(
+          (static_cast<std::uint64_t>(id) * 0x9E3779B97F4A7C15ull) >> shift_);
+      }
+
+      size_t next(size_t i) const { return (i + 1) & (entries_.size() - 1); }
+
+      void insertNew(size_t id, size_t index) {
+        size_t i = home(id);
+        while (entries_[i].used) i = next(i);
+        entries_[i] = {id, index, true};
+        size_++;
+      }
+
+      // slots is a power of two
+      void rehash(size_t slots) {
+        std::vector<Entry> old(slots, Entry{0, 0, false});
+        old.swap(entries_);
+        shift_ = 64;
+        for (size_t s = slots; s > 1; s /= 2) shift_--;
+        size_ = 0;
+        for (const Entry& entry : old) {
+          if (entry.used) insertNew(entry.id, entry.index);
+        }
+        growths_++;
+      }
+
+      std::vector<Entry> entries_;
+      size_t size_;
+      unsigned shift_;
+      size_t growths_;
+  };
+}
+
+#endif
@@ -1,6 +1,7 @@
 
 #pragma once
 
+#include <msckf_mono/scratch_arena.h>
 #include <msckf_mono/types.h>
 
 namespace msckf_mono {
@@ -49,6 +50,141 @@ namespace msckf_mono {
       return cond;
     }
 
+  // Layout of a single 3x3 block in a block-structured matrix
+  enum BlockType { ZeroBlock, IdentityBlock, DenseBlock };
+
+  // Computes out = A * in where A is partitioned into 3x3 blocks whose
+  // layout is known at compile time through _Mask::block(i, j). Zero blocks
+  // are skipped and identity blocks become row copies.
+  //
+  // A - 3B x 3B, _Mask::Blocks = B
+  // in - 3B x N
+  // out - 3B x N, must not alias in
+  template <typename _Mask, typename _DerivedA, typename _DerivedIn, typename _DerivedOut>
+    inline void blockSparseProduct(const Eigen::MatrixBase<_DerivedA>& A,
+                                   const Eigen::MatrixBase<_DerivedIn>& in,
+                                   Eigen::MatrixBase<_DerivedOut>& out){
+      for(int i=0; i<_Mask::Blocks; i++){
+        auto out_rows = out.template middleRows<3>(3*i);
+        bool assigned = false;
+        for(int k=0; k<_Mask::Blocks; k++){
+          switch(_Mask::block(i, k)){
+            case ZeroBlock:
+              break;
+            case IdentityBlock:
+              if(assigned)
+                out_rows += in.template middleRows<3>(3*k);
+              else
+                out_rows = in.template middleRows<3>(3*k);
+              assigned = true;
+              break;
+            case DenseBlock:
+              if(assigned)
+                out_rows.noalias() += A.template block<3, 3>(3*i, 3*k) * in.template middleRows<3>(3*k);
+              else
+                out_rows.noalias() = A.template block<3, 3>(3*i, 3*k) * in.template middleRows<3>(3*k);
+              assigned = true;
+              break;
+          }
+        }
+        if(!assigned)
+          out_rows.setZero();
+      }
+    }
+
+  // Removes the direction u from the row space of A in place,
+  // A <- A - (A u) u^T / (u^T u). This is A (I - u (u^T u)^-1 u^T) as a
+  // rank-1 update, without forming the projector or inverting u^T u.
+  template <typename _DerivedA, typename _Derivedu>
+    inline void projectOutDirection(Eigen::MatrixBase<_DerivedA>& A,
+                                    const Eigen::MatrixBase<_Derivedu>& u){
+      const auto Au = (A * u).eval();
+      A.noalias() -= (Au / u.squaredNorm()) * u.transpose();
+    }
+
+  // Kalman update of the symmetric covariance P with the measurement
+  // Jacobian H, residual r and noise noise_var * I. Solves with a Cholesky
+  // factor L of the innovation covariance S = H * P * H^T + noise_var * I
+  // instead of inverting it, for the transposed gain K^T = S^-1 * H * P and
+  // the correction delta_x = K * r.
+  //
+  // P first takes the downdate P - K * S * K^T = P - W * W^T with W = K * L,
+  // then one correction against H * P' = noise_var * K^T, which the exact
+  // posterior P' satisfies. With R = H * P - noise_var * K^T from the
+  // downdated P,
+  //   P - (K * R + R^T * K^T) / 2
+  // damps the rounding error E of the downdate to
+  // (E * (I - K * H)^T + (I - K * H) * E) / 2, as the Joseph form evaluated
+  // through (I - K * H) * P does, and so keeps P about as close to positive
+  // semi-definite in single precision. Both steps accumulate only the upper
+  // triangle, by a rank-K update and triangular products, and mirror it, so
+  // no N x N temporary is formed and P costs two and a half N x N x K
+  // products where the Joseph form costs three.
+  //
+  // P - N x N, both triangles
+  // H - K x N
+  // r - K x 1
+  // delta_x - N x 1, sized by the caller
+  // Temporaries come from scratch, so the Cholesky path does not touch the
+  // heap once the arena is warm.
+  // If rounding leaves S indefinite, falls back to an LDLT solve for the
+  // gain, which allocates; used_ldlt, if given, is set to whether it did.
+  // Returns false and leaves P alone only if that fails too.
+  template <typename _Scalar, typename _DerivedP, typename _DerivedH,
+            typename _Derivedr, typename _Derivedx>
+    inline bool choleskyKalmanUpdate(Eigen::MatrixBase<_DerivedP>& P,
+                                     const Eigen::MatrixBase<_DerivedH>& H,
+                                     const Eigen::MatrixBase<_Derivedr>& r,
+                                     const _Scalar& noise_var,
+                                     Eigen::MatrixBase<_Derivedx>& delta_x,
+                                     ScratchArena& scratch,
+                                     bool* used_ldlt = nullptr) {
+      const Eigen::Index N = P.rows(), K = H.rows();
+      auto PHt = scratch.matrix<_Scalar>(N, K);
+      PHt.noalias() = P * H.transpose();
+      auto S = scratch.matrix<_Scalar>(K, K);
+      S.template triangularView<Eigen::Lower>() = H * PHt;
+      S.diagonal().array() += noise_var;
+
+      auto Kt = scratch.matrix<_Scalar>(K, N);
+      Kt = PHt.transpose();
+      auto P_upper = P.template triangularView<Eigen::Upper>();
+      // Factored in place from the lower triangle, S now holds L
+      Eigen::LLT<Eigen::Ref<MatrixX<_Scalar>>> llt(S);
+      if (used_ldlt) *used_ldlt = llt.info() != Eigen::Success;
+      if (llt.info() == Eigen::Success) {
+        const auto L = S.template triangularView<Eigen::Lower>();
+        // W^T = L^-1 * H * P, then K^T = L^-T * W^T
+        L.solveInPlace(Kt);
+        P.template selfadjointView<Eigen::Upper>().rankUpdate(Kt.transpose(), _Scalar(-1));
+        L.transpose().solveInPlace(Kt);
+      } else {
+        // S lost definiteness to rounding (e.g. a nearly singular P in single
+        // precision). Fall back to a pivoted LDLT solve, downdating by
+        // K * H * P in place of W * W^T.
+        S.noalias() = H * PHt;
+        S.diagonal().array() += noise_var;
+        Eigen::LDLT<MatrixX<_Scalar>> ldlt(S);
+        if (ldlt.info() != Eigen::Success) {
+          return false;
+        }
+        Kt = ldlt.solve(PHt.transpose());
+        P_upper -= Kt.transpose() * PHt.transpose();
+      }
+      delta_x.noalias() = Kt.transpose() * r;
+      P.template triangularView<Eigen::StrictlyLower>() = P.transpose();
+
+      // R = H * P - noise_var * K^T, halved for the two sides
+      auto R = scratch.matrix<_Scalar>(K, N);
+      R.noalias() = H * P;
+      R -= noise_var * Kt;
+      R *= _Scalar(0.5);
+      P_upper -= Kt.transpose() * R;
+      P_upper -= R.transpose() * Kt;
+      P.template triangularView<Eigen::StrictlyLower>() = P.transpose();
+      return true;
+    }
+
   // Slice columns and rows at indices inds from in to out
   //
   // in - M x M
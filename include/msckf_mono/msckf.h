@@ -2,6 +2,7 @@
 #define MSCKF_HPP_
 
 #include <iostream>
+#include <array>
 #include <vector>
 #include <set>
 #include <map>
@@ -9,6 +10,10 @@
 #include <limits>
 #include <algorithm>
 #include <cmath>
+#include <type_traits>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include <ctime>
 #include <stdexcept>
 
@@ -20,6 +25,8 @@
 
 #include <msckf_mono/types.h>
 #include <msckf_mono/matrix_utils.h>
+#include <msckf_mono/scratch_arena.h>
+#include <msckf_mono/id_index_map.h>
 
 using namespace Eigen;
 
@@ -28,30 +35,101 @@ using namespace Eigen;
  *		- The thing with the quaternions being inverted
  */
 namespace msckf_mono {
-  template <typename _S>
+  // _MaxCamStates bounds max_cam_states at compile time. When it is given,
+  // the covariance buffers are fixed-capacity members of the filter instead
+  // of heap allocations; the default keeps them Dynamic.
+  template <typename _S, int _MaxCamStates = Dynamic>
     class MSCKF {
+    public:
+      static constexpr int MaxCamStates = _MaxCamStates;
+      // augmentState adds a state before the pruning functions run, so leave
+      // room for two more than the window
+      static constexpr int MaxCovarDim =
+        _MaxCamStates == Dynamic ? Dynamic : 15 + 6 * (_MaxCamStates + 2);
+
     private: 
+      // A fixed covariance is too large for Eigen's fixed-size storage, so it
+      // is a plain array viewed through a Map, like the growable buffer.
+      typedef typename std::conditional<_MaxCamStates == Dynamic,
+        std::vector<_S, Eigen::aligned_allocator<_S>>,
+        std::array<_S, _MaxCamStates == Dynamic ? 1 : MaxCovarDim * MaxCovarDim>>::type
+        CovarStorage;
+      typedef Map<MatrixX<_S>> CovarMap;
+
       Camera<_S> camera_;
       noiseParams<_S> noise_params_;
       MSCKFParams<_S> msckf_params_;
       // prunedStates;
-      std::vector<featureTrack<_S>> feature_tracks_;
-      std::vector<size_t> tracked_feature_ids_;
+      // Active feature tracks. Tracks live in slot-stable storage whose free
+      // slots are reused, with a feature id -> slot index for lookups and a
+      // dense list of active slots for iteration. track_positions_ holds each
+      // slot's place in that list so a track is removed by swapping it with
+      // the last one. See addTrack and removeTrack.
+      std::vector<featureTrack<_S>> track_slots_;
+      std::vector<size_t> free_track_slots_;
+      IdIndexMap track_slot_by_id_;
+      std::vector<size_t> active_track_slots_;
+      std::vector<size_t> track_positions_;
 
       std::vector<featureTrackToResidualize<_S>> feature_tracks_to_residualize_;
+      observationArena<_S> residual_obs_;
+      // Scratch observations of the tracks updated in pruneRedundantStates
+      observationArena<_S> prune_obs_;
+      // Scratch observations of the tracks passed to triangulateBatch
+      observationArena<_S> batch_obs_;
       size_t num_feature_tracks_residualized_;
       std::vector<size_t> tracks_to_remove_;
       size_t last_feature_id_;
 
       imuState<_S> imu_state_;
-      std::vector<camState<_S>> cam_states_;
+      camStateVector<_S> cam_states_;
+      // state_id -> position in cam_states_ (and camera block in the covariance), kept
+      // in sync by augmentState and removeCamStates
+      IdIndexMap cam_state_positions_;
+      // tracked_feature_ids buffers of removed camera states, handed to new
+      // ones by augmentState
+      std::vector<std::vector<size_t>> spare_feature_id_lists_;
+      // Camera states to remove and, by position, to keep, for the pruning
+      // functions
+      std::vector<size_t> rm_cam_state_ids_;
+      std::vector<bool> cam_state_keep_;
+
+      camStateVector<_S> pruned_states_;
+
+      // Measurement updates dropped because the innovation covariance could
+      // not be factored
+      size_t num_skipped_updates_;
+
+      // Sums over measurement updates of the largest camera state correction,
+      // bounding how far any camera state has moved between two points in
+      // time. The triangulation cache compares against them.
+      _S cam_travel_distance_;
+      _S cam_travel_angle_;
+      size_t triangulation_cache_hits_;
+      size_t triangulation_cache_misses_;
+
+      // Heap allocations made outside the scratch arenas and the id maps,
+      // counted where they happen: container growth (see append), covariance
+      // growth and the LDLT fallbacks. See getHeapAllocations.
+      size_t heap_allocations_;
 
-      std::vector<camState<_S>> pruned_states_;
       std::vector<Vector3<_S>, Eigen::aligned_allocator<Vector3<_S>>> map_;
 
-      Matrix<_S,15,15> imu_covar_;
-      MatrixX<_S> cam_covar_;
-      Matrix<_S,15,Dynamic> imu_cam_covar_;
+      // Full [IMU, camera states] covariance, a covar_capacity_ square buffer
+      // (see covarBuffer()). It is allocated for max_cam_states camera states
+      // up front and only reallocated if that is exceeded; the live covariance
+      // is its top-left covar_dim_ square, see covar(), imuCovar(),
+      // imuCamCovar() and camCovar().
+      CovarStorage covar_storage_;
+      size_t covar_capacity_;
+      size_t covar_dim_;
+
+      // Temporaries of marginalize, pruneRedundantStates and
+      // measurementUpdate, reset at the start of each frame in augmentState.
+      // The parallel per-track work takes its temporaries from one arena per
+      // worker thread instead, see workerScratch.
+      ScratchArena scratch_;
+      std::vector<ScratchArena> worker_scratch_;
 
       std::vector<_S> chi_squared_test_table;
       Vector3<_S> pos_init_;
@@ -59,9 +137,30 @@ namespace msckf_mono {
 
       Matrix<_S,15,15> F_;
       Matrix<_S,15,15> Phi_;
-      Matrix<_S,15,12> G_;
-
-      MatrixX<_S> P_;
+      Matrix<_S,15,15> GQGt_;
+      bool GQGt_orientation_free_;
+      Matrix<_S,15,15> imu_covar_tmp_;
+      Matrix<_S,15,Dynamic,ColMajor,15,MaxCovarDim> imu_cam_covar_tmp_;
+
+      // Product of the Phi_ of every IMU sample since imuCamCovar() was last
+      // brought up to date, see applyPendingPropagation
+      Matrix<_S,15,15> Phi_accum_;
+      bool propagation_pending_;
+
+      // Non-zero 3x3 blocks of Phi_ over (theta, b_g, v, b_a, p), as produced by
+      // both the matrix exponential and the closed form of calcF's structure.
+      struct PhiBlockMask {
+        static constexpr int Blocks = 5;
+        static constexpr BlockType block(int i, int j) {
+          constexpr BlockType layout[5][5] = {
+            {DenseBlock, DenseBlock, ZeroBlock,     ZeroBlock,     ZeroBlock},
+            {ZeroBlock,  IdentityBlock, ZeroBlock,  ZeroBlock,     ZeroBlock},
+            {DenseBlock, DenseBlock, IdentityBlock, DenseBlock,    ZeroBlock},
+            {ZeroBlock,  ZeroBlock,  ZeroBlock,     IdentityBlock, ZeroBlock},
+            {DenseBlock, DenseBlock, DenseBlock,    DenseBlock,    IdentityBlock}};
+          return layout[i][j];
+        }
+      };
 
     public:
       EIGEN_MAKE_ALIGNED_OPERATOR_NEW
@@ -74,17 +173,43 @@ namespace msckf_mono {
                       const MSCKFParams<_S>& msckf_params,
                       const imuState<_S>& imu_state) {
         // Constructor:
+        if (_MaxCamStates != Dynamic && msckf_params.max_cam_states > _MaxCamStates) {
+          throw std::runtime_error("MSCKF: max_cam_states exceeds the MaxCamStates of this filter");
+        }
         camera_ = camera;
         noise_params_ = noise_params;
         msckf_params_ = msckf_params;
+        // Worker count for the parallel loops and their scratch arenas
+        msckf_params_.num_threads = std::max(1, msckf_params_.num_threads);
         num_feature_tracks_residualized_ = 0;
+        num_skipped_updates_ = 0;
+        cam_travel_distance_ = 0;
+        cam_travel_angle_ = 0;
+        triangulation_cache_hits_ = 0;
+        triangulation_cache_misses_ = 0;
+        heap_allocations_ = 0;
         imu_state_ = imu_state;
         pos_init_ = imu_state_.p_I_G;
         imu_state_.p_I_G_null = imu_state_.p_I_G;
         imu_state_.v_I_G_null = imu_state_.v_I_G;
         imu_state_.q_IG_null = imu_state_.q_IG;
-        imu_covar_ = noise_params.initial_imu_covar;
+        covar_dim_ = 15;
+        covar_capacity_ = 0;
+        reserveCovar(msckf_params_.max_cam_states + 2);
+        // The window and its bookkeeping, so that steady-state frames do not
+        // allocate
+        const size_t max_window = msckf_params_.max_cam_states + 2;
+        reserveCapacity(cam_states_, max_window);
+        reserveCapacity(spare_feature_id_lists_, max_window);
+        reserveCapacity(rm_cam_state_ids_, max_window);
+        reserveCapacity(cam_state_keep_, max_window);
+        cam_state_positions_.reserve(max_window);
+        imuCovar() = noise_params.initial_imu_covar;
         last_feature_id_ = 0;
+        initGQGt();
+        Phi_accum_.setIdentity();
+        propagation_pending_ = false;
+        worker_scratch_.resize(msckf_params_.num_threads);
 
         // Initialize the chi squared test table with confidence
         // level 0.95.
@@ -100,15 +225,19 @@ namespace msckf_mono {
       // using the acceleration and angular velocity in measurement.
       void propagate(imuReading<_S> &measurement_) {
         calcF(imu_state_, measurement_);
-        calcG(imu_state_);
+        calcGQGt(imu_state_);
 
         imuState<_S> imu_state_prop = propogateImuStateRK(imu_state_, measurement_);
 
-        // F * dt
-        F_ *= measurement_.dT;
+        if (msckf_params_.transition_method == ClosedForm) {
+          calcPhiClosedForm(measurement_.dT);
+        } else {
+          // F * dt
+          F_ *= measurement_.dT;
 
-        // Matrix exponential
-        Phi_ = F_.exp();
+          // Matrix exponential
+          Phi_ = F_.exp();
+        }
 
         // Apply observability constraints - enforce nullspace of Phi
         // Ref: Observability-constrained Vision-aided Inertial Navigation, Hesch J.
@@ -131,8 +260,12 @@ namespace msckf_mono {
         Vector3<_S> w2 = vectorToSkewSymmetric(tmp) * imu_state_.g;
         Phi_.template block<3, 3>(12, 0) = A2 - (A2 * u - w2) * s;
 
-        Matrix<_S, 15, 15> imu_covar_prop = Phi_ * (imu_covar_ + G_ * noise_params_.Q_imu * G_.transpose() * measurement_.dT) * Phi_.transpose();
-
+        // Phi * (P + G * Q * G^T * dT) * Phi^T, using the block structure of Phi.
+        // The inner matrix is symmetric so both products are left multiplies.
+        auto imu_covar = imuCovar();
+        imu_covar += GQGt_ * measurement_.dT;
+        blockSparseProduct<PhiBlockMask>(Phi_, imu_covar, imu_covar_tmp_);
+        blockSparseProduct<PhiBlockMask>(Phi_, imu_covar_tmp_.transpose(), imu_covar);
 
         // Apply updates directly
         imu_state_ = imu_state_prop;
@@ -140,21 +273,50 @@ namespace msckf_mono {
         imu_state_.v_I_G_null = imu_state_.v_I_G;
         imu_state_.p_I_G_null = imu_state_.p_I_G;
 
-        imu_covar_ = (imu_covar_prop + imu_covar_prop.transpose()) / 2.0;
-        imu_cam_covar_ = Phi_ * imu_cam_covar_;
+        imu_covar_tmp_ = (imu_covar + imu_covar.transpose()) / 2.0;
+        imu_covar = imu_covar_tmp_;
+
+        // The IMU-camera cross-covariance only ever sees the product of the
+        // Phi_ between two camera frames. Compose it here (15x15, same block
+        // layout) and apply it once instead of a 15 x 6N product per sample.
+        if (covar_dim_ > 15) {
+          blockSparseProduct<PhiBlockMask>(Phi_, Phi_accum_, imu_covar_tmp_);
+          Phi_accum_ = imu_covar_tmp_;
+          propagation_pending_ = true;
+        }
+      }
+
+      // Propagates imu_state by one IMU measurement without a covariance or
+      // any filter state, for predicting the pose between camera updates.
+      // Uses no members, so it is safe alongside a filter running elsewhere.
+      static imuState<_S> propagateNominal(const imuState<_S> &imu_state,
+                                           const imuReading<_S> &measurement) {
+        return propogateImuStateRK(imu_state, measurement);
       }
 
       // Generates a new camera state and adds it to the full state and covariance.
+      // state_id must not already be in the window: tracks and the
+      // covariance index find camera states by id.
       void augmentState(const int& state_id, const _S& time) {
+        if (cam_state_positions_.contains(state_id)) {
+          throw std::runtime_error("MSCKF: camera state id is already in the window");
+        }
         map_.clear();
+        applyPendingPropagation();
+        resetScratch();
 
         // Compute camera_ pose from current IMU pose
         Quaternion<_S> q_CG = camera_.q_CI * imu_state_.q_IG;
 
         q_CG.normalize();
         camState<_S> cam_state;
+        if (!spare_feature_id_lists_.empty()) {
+          cam_state.tracked_feature_ids = std::move(spare_feature_id_lists_.back());
+          spare_feature_id_lists_.pop_back();
+        }
         cam_state.last_correlated_id = -1;
         cam_state.q_CG = q_CG;
+        refreshCamRotation(cam_state);
 
         cam_state.p_C_G =
           imu_state_.p_I_G + imu_state_.q_IG.inverse() * camera_.p_C_I;
@@ -162,53 +324,37 @@ namespace msckf_mono {
         cam_state.time = time;
         cam_state.state_id = state_id;
 
-        // Build MSCKF covariance matrix
-        if (cam_states_.size()) {
-          P_.resize(15 + cam_covar_.cols(), 15 + cam_covar_.cols());
-          P_.template block<15, 15>(0, 0) = imu_covar_;
-          P_.block(0, 15, 15, cam_covar_.cols()) = imu_cam_covar_;
-          P_.block(15, 0, cam_covar_.cols(), 15) = imu_cam_covar_.transpose();
-          P_.block(15, 15, cam_covar_.rows(), cam_covar_.cols()) = cam_covar_;
-        } else {
-          P_ = imu_covar_;
-        }
-
-        if (P_.determinant() < -0.000001) {
-          //ROS_ERROR("Covariance determinant is negative! %f", P.determinant());
-        }
-
-        MatrixX<_S> J = MatrixX<_S>::Zero(6, 15 + 6 * cam_states_.size());
-        J.template block<3, 3>(0, 0) = camera_.q_CI.toRotationMatrix();
-        J.template block<3, 3>(3, 0) =
+        // Camera<_S> State Jacobian. Only its first 15 columns are non-zero:
+        // J = [R_CI 0 0 0 0; skew(q_IG^-1 * p_C_I) 0 0 0 I]
+        // so the new rows J * P of the augmented covariance
+        // [P, P J^T; J P, J P J^T] only need the theta and p rows of P.
+        const Matrix3<_S> R_CI = camera_.q_CI.toRotationMatrix();
+        const Matrix3<_S> J_p =
           vectorToSkewSymmetric(imu_state_.q_IG.inverse() * camera_.p_C_I);
-        J.template block<3, 3>(3, 12) = Matrix3<_S>::Identity();
+        const size_t N = covar_dim_;
 
-        // Camera<_S> State Jacobian
-        // MatrixX<_S> J = calcJ(imu_state_, cam_states_);
-
-        MatrixX<_S> tempMat = MatrixX<_S>::Identity(15 + 6 * cam_states_.size() + 6,
-                                                    15 + 6 * cam_states_.size());
-        tempMat.block(15 + 6 * cam_states_.size(), 0, 6,
-                      15 + 6 * cam_states_.size()) = J;
-
-        // Augment the MSCKF covariance matrix
-        MatrixX<_S> P_aug = tempMat * P_ * tempMat.transpose();
-
-        MatrixX<_S> P_aug_sym = (P_aug + P_aug.transpose()) / 2.0;
-
-        P_aug = P_aug_sym;
-
-        // Break everything into appropriate structs
-        cam_states_.push_back(cam_state);
-        imu_covar_ = P_aug.template block<15, 15>(0, 0);
-
-        cam_covar_.resize(P_aug.rows() - 15, P_aug.cols() - 15);
-        cam_covar_ = P_aug.block(15, 15, P_aug.rows() - 15, P_aug.cols() - 15);
-
-        imu_cam_covar_.resize(15, P_aug.cols() - 15);
-        imu_cam_covar_ = P_aug.block(0, 15, 15, P_aug.cols() - 15);
-
-        VectorX<_S> cov_diag = imu_covar_.diagonal();
+        if (N + 6 > covar_capacity_) {
+          reserveCovar(2 * (cam_states_.size() + 1));
+        }
+        auto covar_buffer = covarBuffer();
+
+        // Augment the MSCKF covariance matrix in place
+        covar_buffer.block(N, 0, 3, N).noalias() = R_CI * covar_buffer.block(0, 0, 3, N);
+        covar_buffer.block(N + 3, 0, 3, N).noalias() = J_p * covar_buffer.block(0, 0, 3, N);
+        covar_buffer.block(N + 3, 0, 3, N) += covar_buffer.block(12, 0, 3, N);
+        covar_buffer.block(0, N, N, 6) = covar_buffer.block(N, 0, 6, N).transpose();
+
+        Matrix<_S, 6, 6> JPJt;
+        JPJt.template leftCols<3>() =
+          covar_buffer.template block<6, 3>(N, 0) * R_CI.transpose();
+        JPJt.template rightCols<3>() =
+          covar_buffer.template block<6, 3>(N, 0) * J_p.transpose() +
+          covar_buffer.template block<6, 3>(N, 12);
+        covar_buffer.template block<6, 6>(N, N) = (JPJt + JPJt.transpose()) / 2.0;
+        covar_dim_ = N + 6;
+
+        cam_state_positions_.set(state_id, cam_states_.size());
+        append(cam_states_, std::move(cam_state));
       }
 
       // Updates the positions of tracked features at the current timestamp.
@@ -216,85 +362,55 @@ namespace msckf_mono {
                   const std::vector<size_t> &feature_ids) {
 
         feature_tracks_to_residualize_.clear();
+        residual_obs_.clear();
         tracks_to_remove_.clear();
 
-        int id_iter = 0;
-        // Loop through all features being tracked
-        for (auto feature_id : tracked_feature_ids_) {
-          // Check if old feature is seen in current measurements
-          auto input_feature_ids_iter =
-            find(feature_ids.begin(), feature_ids.end(), feature_id);
-          bool is_valid = (input_feature_ids_iter != feature_ids.end());
+        camState<_S> &cam_state = cam_states_.back();
+        reserveCapacity(cam_state.tracked_feature_ids, feature_ids.size());
 
-          // If so, get the relevant track
-          auto track = feature_tracks_.begin() + id_iter;
+        // Add the observations of features that are still being tracked
+        for (size_t i = 0; i < feature_ids.size(); i++) {
+          const size_t slot = track_slot_by_id_.find(feature_ids[i]);
+          if (slot == IdIndexMap::npos) continue;
 
-          // If we're still tracking this point, add the observation
-          if (is_valid) {
-            size_t feature_ids_dist =
-              distance(feature_ids.begin(), input_feature_ids_iter);
-            track->observations.push_back(measurements[feature_ids_dist]);
-
-            auto cam_state_iter = cam_states_.end() - 1;
-            cam_state_iter->tracked_feature_ids.push_back(feature_id);
+          featureTrack<_S> &track = track_slots_[slot];
+          append(track.observations, measurements[i]);
+          append(track.cam_state_indices, cam_state.state_id);
+          track.triangulation.current = false;
+          cam_state.tracked_feature_ids.push_back(feature_ids[i]);
+        }
 
-            track->cam_state_indices.push_back(cam_state_iter->state_id);
-          }
+        // Loop through all features being tracked
+        for (size_t slot : active_track_slots_) {
+          featureTrack<_S> &track = track_slots_[slot];
+          bool is_valid = !track.cam_state_indices.empty() &&
+            track.cam_state_indices.back() == cam_state.state_id;
 
           // If corner is not valid or track is too long, remove track to be
           // residualized
-          if (!is_valid  || (track->observations.size() >=
+          if (!is_valid  || (track.observations.size() >=
                              msckf_params_.max_track_length))
           {
-            featureTrackToResidualize<_S> track_to_residualize;
-            removeTrackedFeature(feature_id, track_to_residualize.cam_states,
-                                 track_to_residualize.cam_state_indices);
-
-            // If track is long enough, add to the residualized list
-            if (track_to_residualize.cam_states.size() >=
-                msckf_params_.min_track_length) {
-              track_to_residualize.feature_id = track->feature_id;
-              track_to_residualize.observations = track->observations;
-              track_to_residualize.initialized = track->initialized;
-              if (track->initialized) track_to_residualize.p_f_G = track->p_f_G;
-
-              feature_tracks_to_residualize_.push_back(track_to_residualize);
-            }
-
-            tracks_to_remove_.push_back(feature_id);
+            residualizeTrack(track);
+            append(tracks_to_remove_, track.feature_id);
           }
-
-          id_iter++;
         }
 
-        // TODO: Double check this stuff and maybe use use non-pointers for accessing
-        // elements so that it only requires one pass
-
         for (auto feature_id : tracks_to_remove_) {
-          auto track_iter = feature_tracks_.begin();
-          while (track_iter != feature_tracks_.end()) {
-            if (track_iter->feature_id == feature_id) {
-              size_t last_id = track_iter->cam_state_indices.back();
-              for (size_t index : track_iter->cam_state_indices) {
-                for (auto &camstate : cam_states_) {
-                  if (!camstate.tracked_feature_ids.size() &&
-                      camstate.state_id == index) {
-                    camstate.last_correlated_id = last_id;
-                  }
-                }
+          size_t slot = track_slot_by_id_.find(feature_id);
+          const featureTrack<_S> &track = track_slots_[slot];
+          if (!track.cam_state_indices.empty()) {
+            size_t last_id = track.cam_state_indices.back();
+            for (size_t index : track.cam_state_indices) {
+              size_t position = camStatePosition(index);
+              if (position < cam_states_.size() &&
+                  !cam_states_[position].tracked_feature_ids.size()) {
+                cam_states_[position].last_correlated_id = last_id;
               }
-              track_iter = feature_tracks_.erase(track_iter);
-              break;
-            } else
-              track_iter++;
+            }
           }
 
-          auto corresponding_id = std::find(tracked_feature_ids_.begin(),
-                                            tracked_feature_ids_.end(), feature_id);
-
-          if (corresponding_id != tracked_feature_ids_.end()) {
-            tracked_feature_ids_.erase(corresponding_id);
-          }
+          removeTrack(slot);
         }
       }
 
@@ -306,24 +422,19 @@ namespace msckf_mono {
         // IDs
         // Will assume feature IDs are unique per feature per call
         // TODO: revisit this assumption if necessary
-        using camStateIter = typename std::vector<camState<_S>>::iterator;
+        using camStateIter = typename camStateVector<_S>::iterator;
 
         for (size_t i = 0; i < features.size(); i++) {
           size_t id = feature_ids[i];
-          if (std::find(tracked_feature_ids_.begin(), tracked_feature_ids_.end(),
-                        id) == tracked_feature_ids_.end()) {
+          if (!track_slot_by_id_.contains(id)) {
             // New feature
-            featureTrack<_S> track;
-            track.feature_id = feature_ids[i];
-            track.observations.push_back(features[i]);
+            featureTrack<_S> &track = addTrack(id);
+            append(track.observations, features[i]);
 
             camStateIter cam_state_last = cam_states_.end() - 1;
-            cam_state_last->tracked_feature_ids.push_back(feature_ids[i]);
-
-            track.cam_state_indices.push_back(cam_state_last->state_id);
+            append(cam_state_last->tracked_feature_ids, feature_ids[i]);
 
-            feature_tracks_.push_back(track);
-            tracked_feature_ids_.push_back(feature_ids[i]);
+            append(track.cam_state_indices, cam_state_last->state_id);
           } else {
             std::cout << "Error, added new feature that was already being tracked" << std::endl;
             return;
@@ -334,6 +445,8 @@ namespace msckf_mono {
       // Finds feature tracks that have been lost, removes them from the filter, and uses them
       // to update the camera states that observed them.
       void marginalize() {
+        applyPendingPropagation();
+
         if (!feature_tracks_to_residualize_.empty()) {
           int num_passed, num_rejected, num_ransac, max_length, min_length;
           _S max_norm, min_norm;
@@ -345,47 +458,59 @@ namespace msckf_mono {
           max_norm = -1;
           min_norm = std::numeric_limits<_S>::infinity();
 
-          std::vector<bool> valid_tracks;
-          std::vector<Vector3<_S>, Eigen::aligned_allocator<Vector3<_S>>> p_f_G_vec;
+          const int num_tracks = feature_tracks_to_residualize_.size();
+          char *valid_tracks = scratch_.allocate<char>(num_tracks);
+          auto p_f_G_vec = scratch_.matrix<_S>(3, num_tracks);
           int total_nObs = 0;
 
-          for (auto track = feature_tracks_to_residualize_.begin();
-               track != feature_tracks_to_residualize_.end(); track++) {
-            if (num_feature_tracks_residualized_ > 3 &&
-                !checkMotion(track->observations.front(), track->cam_states)) {
+          // checkMotion only rejects tracks once more than 3 have been
+          // residualized; that count only grows, so past it a track failing
+          // checkMotion is never triangulated.
+          const bool check_motion = num_feature_tracks_residualized_ > 3;
+          char *has_motion = scratch_.allocate<char>(num_tracks);
+          char *has_position = scratch_.allocate<char>(num_tracks);
+
+#ifdef _OPENMP
+          #pragma omp parallel for schedule(dynamic) num_threads(msckf_params_.num_threads)
+#endif
+          for (int iter = 0; iter < num_tracks; iter++) {
+            const auto &track = feature_tracks_to_residualize_[iter];
+            has_motion[iter] = checkMotion(residual_obs_, track.obs_begin, track.num_obs);
+          }
+
+          // Estimate feature 3D location with intersection, LM
+          triangulationJob<_S> *jobs = scratch_.allocate<triangulationJob<_S>>(num_tracks);
+          for (int iter = 0; iter < num_tracks; iter++) {
+            auto &track = feature_tracks_to_residualize_[iter];
+            const bool solve = has_motion[iter] || !check_motion;
+            jobs[iter] = {track.obs_begin, solve ? track.num_obs : 0, &track.triangulation};
+          }
+          triangulateTracks(residual_obs_, jobs, num_tracks, p_f_G_vec, has_position);
+
+          for (int iter = 0; iter < num_tracks; iter++) {
+            auto &track = feature_tracks_to_residualize_[iter];
+            valid_tracks[iter] = false;
+            if (num_feature_tracks_residualized_ > 3 && !has_motion[iter]) {
               num_rejected += 1;
-              valid_tracks.push_back(false);
               continue;
             }
 
-            Vector3<_S> p_f_G;
-            _S Jcost, RCOND;
-
-            // Estimate feature 3D location with intersection, LM
-            bool isvalid =
-              initializePosition(track->cam_states, track->observations, p_f_G);
+            bool isvalid = has_position[iter];
 
             if (isvalid) {
-              track->initialized = true;
-              track->p_f_G = p_f_G;
-              map_.push_back(p_f_G);
+              track.initialized = true;
+              track.p_f_G = p_f_G_vec.col(iter);
+              append(map_, p_f_G_vec.col(iter));
             }
 
-            p_f_G_vec.push_back(p_f_G);
-            int nObs = track->observations.size();
-
-            Vector3<_S> p_f_C1 = (track->cam_states[0].q_CG.toRotationMatrix()) *
-              (p_f_G - track->cam_states[0].p_C_G);
-
-            Eigen::Array<_S, 3, 1> p_f_G_array = p_f_G.array();
+            int nObs = track.num_obs;
 
             if (!isvalid)
             {
               num_rejected += 1;
-              valid_tracks.push_back(false);
             } else {
               num_passed += 1;
-              valid_tracks.push_back(true);
+              valid_tracks[iter] = true;
               total_nObs += nObs;
               if (nObs > max_length) {
                 max_length = nObs;
@@ -401,299 +526,221 @@ namespace msckf_mono {
           if (!num_passed) {
             return;
           }
-          MatrixX<_S> H_o = MatrixX<_S>::Zero(2 * total_nObs - 3 * num_passed,
-                                              15 + 6 * cam_states_.size());
-          MatrixX<_S> R_o = MatrixX<_S>::Zero(2 * total_nObs - 3 * num_passed,
-                                              2 * total_nObs - 3 * num_passed);
-          VectorX<_S> r_o(2 * total_nObs - 3 * num_passed);
-
-          Vector2<_S> rep;
-          rep << noise_params_.u_var_prime, noise_params_.v_var_prime;
 
-          int stack_counter = 0;
-          for (int iter = 0; iter < feature_tracks_to_residualize_.size(); iter++) {
+          // Each valid track owns 2M - 3 rows of H_o, starting at row_begin
+          size_t *row_begin = scratch_.allocate<size_t>(num_tracks);
+          size_t num_rows = 0;
+          for (int iter = 0; iter < num_tracks; iter++) {
+            row_begin[iter] = num_rows;
+            if (valid_tracks[iter]) {
+              num_rows += 2 * feature_tracks_to_residualize_[iter].num_obs - 3;
+            }
+          }
+          auto H_o = scratch_.matrix<_S>(num_rows, 15 + 6 * cam_states_.size());
+          auto r_o = scratch_.vector<_S>(num_rows);
+          H_o.setZero();
+
+          // Per-track Jacobians, residuals and gating in parallel, each track
+          // writing only its own rows ...
+          char *passed_gating = scratch_.allocate<char>(num_tracks);
+
+#ifdef _OPENMP
+          #pragma omp parallel for schedule(dynamic) num_threads(msckf_params_.num_threads)
+#endif
+          for (int iter = 0; iter < num_tracks; iter++) {
+            passed_gating[iter] = false;
             if (!valid_tracks[iter]) continue;
 
-            featureTrackToResidualize<_S> track = feature_tracks_to_residualize_[iter];
-
-            Vector3<_S> p_f_G = p_f_G_vec[iter];
-            VectorX<_S> r_j = calcResidual(p_f_G, track.cam_states, track.observations);
-
-            int nObs = track.observations.size();
-            MatrixX<_S> R_j = (rep.replicate(nObs, 1)).asDiagonal();
-
-            // Calculate H_o_j and residual
-            MatrixX<_S> H_o_j, A_j;
-            calcMeasJacobian(p_f_G, track.cam_state_indices, H_o_j, A_j);
+            const featureTrackToResidualize<_S> &track = feature_tracks_to_residualize_[iter];
+            const size_t n = track.num_obs;
+            ScratchArena &scratch = workerScratch();
+            const ScratchArena::Mark mark = scratch.mark();
+
+            const Vector3<_S> p_f_G = p_f_G_vec.col(iter);
+            auto r_j = scratch.vector<_S>(2 * n);
+            calcResidual(p_f_G, residual_obs_, track.obs_begin, n, r_j);
+
+            // Calculate H_o_j and project the residual with it
+            auto H_x_j = scratch.matrix<_S>(2 * n, 6 * n);
+            calcMeasJacobian(p_f_G, residual_obs_, track.obs_begin, n, r_j, H_x_j, scratch);
+            const auto H_o_j = H_x_j.bottomRows(2 * n - 3);
+            const auto r_o_j = r_j.tail(2 * n - 3);
+
+            passed_gating[iter] = gatingTest(H_o_j, residual_obs_, track.obs_begin, n,
+                                             r_o_j, n - 1, scratch);
+            if (passed_gating[iter]) {
+              r_o.segment(row_begin[iter], r_o_j.size()) = r_o_j;
+              scatterCamStateColumns(H_o_j, residual_obs_, track.obs_begin, n,
+                                     row_begin[iter], H_o);
+            }
 
-            // Stacked residuals and friends
-            VectorX<_S> r_o_j = A_j.transpose() * r_j;
-            MatrixX<_S> R_o_j = A_j.transpose() * R_j * A_j;
+            scratch.rewind(mark);
+          }
 
-            if (gatingTest(H_o_j, r_o_j, track.cam_states.size() - 1)) {
-              r_o.segment(stack_counter, r_o_j.size()) = r_o_j;
-              H_o.block(stack_counter, 0, H_o_j.rows(), H_o_j.cols()) = H_o_j;
-              R_o.block(stack_counter, stack_counter, R_o_j.rows(), R_o_j.cols()) =
-                R_o_j;
+          // ... then the rows of the tracks that passed are packed in track
+          // order, so the update does not depend on how they were scheduled
+          int stack_counter = 0;
+          for (int iter = 0; iter < num_tracks; iter++) {
+            if (!passed_gating[iter]) continue;
 
-              stack_counter += H_o_j.rows();
+            const int rows = 2 * feature_tracks_to_residualize_[iter].num_obs - 3;
+            if (stack_counter != row_begin[iter]) {
+              H_o.middleRows(stack_counter, rows) = H_o.middleRows(row_begin[iter], rows);
+              r_o.segment(stack_counter, rows) = r_o.segment(row_begin[iter], rows);
             }
-          }
 
-          H_o.conservativeResize(stack_counter, H_o.cols());
-          r_o.conservativeResize(stack_counter);
-          R_o.conservativeResize(stack_counter, stack_counter);
+            stack_counter += rows;
+          }
 
-          measurementUpdate(H_o, r_o, R_o);
+          measurementUpdate(H_o.topRows(stack_counter), r_o.head(stack_counter),
+                            noise_params_.u_var_prime);
         }
       }
 
       // Removes camera states that are not considered 'keyframes' (too close in distance or
       // angle to their neighboring camera states), and marginalizes their observations.
       void pruneRedundantStates() {
-        // Cap number of cam states used in computation to max_cam_states
-        if (cam_states_.size() < 20){
+        applyPendingPropagation();
+
+        // Cap number of cam states used in computation to max_cam_states.
+        // findRedundantCamStates only removes states once the window is over
+        // it, so there is nothing to do below.
+        if (cam_states_.size() < static_cast<size_t>(msckf_params_.max_cam_states)) {
           return;
         }
 
         // Find two camera states to rmoved
-        std::vector<size_t> rm_cam_state_ids;
+        std::vector<size_t> &rm_cam_state_ids = rm_cam_state_ids_;
         rm_cam_state_ids.clear();
         findRedundantCamStates(rm_cam_state_ids);
 
-        // Find size of jacobian matrix
-        size_t jacobian_row_size = 0;
-        for (auto &feature : feature_tracks_) {
-          std::vector<size_t> involved_cam_state_ids;
-          size_t obs_id;
+        // Flag the states to remove by position
+        std::vector<bool> &to_keep = resetCamStateKeepFlags();
+        for (size_t cam_id : rm_cam_state_ids) {
+          to_keep[camStatePosition(cam_id)] = false;
+        }
+        auto is_removed = [&](size_t state_id) {
+          size_t position = camStatePosition(state_id);
+          return position < to_keep.size() && !to_keep[position];
+        };
+
+        // Collect the features seen by more than one of the removed states.
+        // Those not triangulated yet are triangulated together below.
+        const size_t num_active = active_track_slots_.size();
+        size_t *num_involved = scratch_.allocate<size_t>(num_active);
+        triangulationJob<_S> *jobs = scratch_.allocate<triangulationJob<_S>>(num_active);
+        prune_obs_.clear();
+        for (size_t i = 0; i < num_active; i++) {
+          featureTrack<_S> &feature = track_slots_[active_track_slots_[i]];
           // Check how many camera states to be removed are associated with a given
           // feature
-          for (const auto &cam_id : rm_cam_state_ids) {
-            auto obs_it = find(feature.cam_state_indices.begin(),
-                               feature.cam_state_indices.end(), cam_id);
-            if (obs_it != feature.cam_state_indices.end()) {
-              involved_cam_state_ids.push_back(cam_id);
-              obs_id = distance(feature.cam_state_indices.begin(), obs_it);
-            }
+          num_involved[i] = std::count_if(feature.cam_state_indices.begin(),
+                                          feature.cam_state_indices.end(), is_removed);
+          jobs[i] = {prune_obs_.size(), 0, &feature.triangulation};
+
+          if (num_involved[i] < 2 || feature.initialized) continue;
+          for (size_t j = 0; j < feature.cam_state_indices.size(); j++) {
+            appendObservation(prune_obs_, feature.observations[j],
+                              camStatePosition(feature.cam_state_indices[j]));
+          }
+          if (checkMotion(prune_obs_, jobs[i].obs_begin, feature.cam_state_indices.size())) {
+            jobs[i].num_obs = feature.cam_state_indices.size();
+          } else {
+            prune_obs_.resize(jobs[i].obs_begin);
           }
+        }
+
+        auto p_f_G_vec = scratch_.matrix<_S>(3, num_active);
+        char *has_position = scratch_.allocate<char>(num_active);
+        triangulateTracks(prune_obs_, jobs, num_active, p_f_G_vec, has_position);
+
+        // Find size of jacobian matrix
+        size_t jacobian_row_size = 0;
+        for (size_t i = 0; i < num_active; i++) {
+          featureTrack<_S> &feature = track_slots_[active_track_slots_[i]];
 
-          if (involved_cam_state_ids.size() == 0) continue;
-          if (involved_cam_state_ids.size() == 1) {
-            feature.observations.erase(feature.observations.begin() + obs_id);
-            feature.cam_state_indices.erase(feature.cam_state_indices.begin() +
-                                            obs_id);
+          if (num_involved[i] == 0) continue;
+          if (num_involved[i] == 1) {
+            removeObservations(feature, is_removed);
             continue;
           }
 
           if (!feature.initialized) {
-            std::vector<camState<_S>> feature_associated_cam_states;
-            for (const auto &cam_state : cam_states_) {
-              if (find(feature.cam_state_indices.begin(),
-                       feature.cam_state_indices.end(),
-                       cam_state.state_id) != feature.cam_state_indices.end())
-                feature_associated_cam_states.push_back(cam_state);
-            }
-            if (!checkMotion(feature.observations.front(),
-                             feature_associated_cam_states)) {
-              for (const auto &cam_id : involved_cam_state_ids) {
-                auto cam_it = find(feature.cam_state_indices.begin(),
-                                   feature.cam_state_indices.end(), cam_id);
-                if (cam_it != feature.cam_state_indices.end()) {
-                  size_t obs_idx =
-                    distance(feature.cam_state_indices.begin(), cam_it);
-                  feature.cam_state_indices.erase(cam_it);
-                  feature.observations.erase(feature.observations.begin() + obs_idx);
-                }
-              }
+            if (!has_position[i]) {
+              removeObservations(feature, is_removed);
               continue;
             } else {
-              Vector3<_S> p_f_G;
-              if (!initializePosition(feature_associated_cam_states,
-                                      feature.observations, p_f_G)) {
-                for (const auto &cam_id : involved_cam_state_ids) {
-                  auto cam_it = find(feature.cam_state_indices.begin(),
-                                     feature.cam_state_indices.end(), cam_id);
-                  if (cam_it != feature.cam_state_indices.end()) {
-                    size_t obs_idx =
-                      distance(feature.cam_state_indices.begin(), cam_it);
-                    feature.cam_state_indices.erase(cam_it);
-                    feature.observations.erase(feature.observations.begin() +
-                                               obs_idx);
-                  }
-                }
-                continue;
-              } else {
-                feature.initialized = true;
-                feature.p_f_G = p_f_G;
-                map_.push_back(p_f_G);
-              }
+              feature.initialized = true;
+              feature.p_f_G = p_f_G_vec.col(i);
+              append(map_, feature.p_f_G);
             }
           }
 
-          jacobian_row_size += 2 * involved_cam_state_ids.size() - 3;
+          jacobian_row_size += 2 * num_involved[i] - 3;
         }
 
         // Compute Jacobian and Residual
-        MatrixX<_S> H_x = MatrixX<_S>::Zero(jacobian_row_size, 15 + 6 * cam_states_.size());
-        MatrixX<_S> R_x = MatrixX<_S>::Zero(jacobian_row_size, jacobian_row_size);
-        VectorX<_S> r_x = VectorX<_S>::Zero(jacobian_row_size);
+        auto H_x = scratch_.matrix<_S>(jacobian_row_size, 15 + 6 * cam_states_.size());
+        auto r_x = scratch_.vector<_S>(jacobian_row_size);
+        H_x.setZero();
         int stack_counter = 0;
 
-        Vector2<_S> rep;
-        rep << noise_params_.u_var_prime, noise_params_.v_var_prime;
-
-        for (auto &feature : feature_tracks_) {
-          std::vector<size_t> involved_cam_state_ids;
-          std::vector<Vector2<_S>, Eigen::aligned_allocator<Vector2<_S>>> involved_observations;
-          for (const auto &cam_id : rm_cam_state_ids) {
-            auto cam_it = find(feature.cam_state_indices.begin(),
-                               feature.cam_state_indices.end(), cam_id);
-            if (cam_it != feature.cam_state_indices.end()) {
-              involved_cam_state_ids.push_back(cam_id);
-              involved_observations.push_back(feature.observations[distance(
-                  feature.cam_state_indices.begin(), cam_it)]);
+        for (size_t slot : active_track_slots_) {
+          featureTrack<_S> &feature = track_slots_[slot];
+          prune_obs_.clear();
+          for (size_t j = 0; j < feature.cam_state_indices.size(); j++) {
+            if (is_removed(feature.cam_state_indices[j])) {
+              appendObservation(prune_obs_, feature.observations[j],
+                                camStatePosition(feature.cam_state_indices[j]));
             }
           }
 
-          size_t nObs = involved_cam_state_ids.size();
+          size_t nObs = prune_obs_.size();
           if (nObs == 0) continue;
 
-          std::vector<camState<_S>> involved_cam_states;
-          std::vector<size_t> cam_state_indices;
-          int cam_state_iter = 0;
-          for (const auto &cam_state : cam_states_) {
-            if (find(involved_cam_state_ids.begin(), involved_cam_state_ids.end(),
-                     cam_state.state_id) != involved_cam_state_ids.end()) {
-              involved_cam_states.push_back(cam_state);
-              cam_state_indices.push_back(cam_state_iter);
-            }
-            cam_state_iter++;
-          }
-
           // Calculate H_xj and residual
-          VectorX<_S> r_j =
-            calcResidual(feature.p_f_G, involved_cam_states, involved_observations);
-
-          MatrixX<_S> R_j = (rep.replicate(nObs, 1)).asDiagonal();
+          const ScratchArena::Mark mark = scratch_.mark();
+          auto r_j = scratch_.vector<_S>(2 * nObs);
+          calcResidual(feature.p_f_G, prune_obs_, 0, nObs, r_j);
 
-          MatrixX<_S> H_x_j, A_j;
-          calcMeasJacobian(feature.p_f_G, cam_state_indices, H_x_j, A_j);
+          auto H_j = scratch_.matrix<_S>(2 * nObs, 6 * nObs);
+          calcMeasJacobian(feature.p_f_G, prune_obs_, 0, nObs, r_j, H_j, scratch_);
+          const auto H_x_j = H_j.bottomRows(2 * nObs - 3);
+          const auto r_x_j = r_j.tail(2 * nObs - 3);
 
-          // Stacked residuals and friends
-          VectorX<_S> r_x_j = A_j.transpose() * r_j;
-          MatrixX<_S> R_x_j = A_j.transpose() * R_j * A_j;
-
-          if (gatingTest(H_x_j, r_x_j, nObs - 1)) {
+          if (gatingTest(H_x_j, prune_obs_, 0, nObs, r_x_j, nObs - 1, scratch_)) {
             r_x.segment(stack_counter, r_x_j.size()) = r_x_j;
-            H_x.block(stack_counter, 0, H_x_j.rows(), H_x_j.cols()) = H_x_j;
-            R_x.block(stack_counter, stack_counter, R_x_j.rows(), R_x_j.cols()) =
-              R_x_j;
+            scatterCamStateColumns(H_x_j, prune_obs_, 0, nObs, stack_counter, H_x);
 
             stack_counter += H_x_j.rows();
           }
+          scratch_.rewind(mark);
 
           // Done, now remove these cam states registrations and corresponding
           // observations from the feature
-          for (const auto &cam_id : involved_cam_state_ids) {
-            auto cam_it = find(feature.cam_state_indices.begin(),
-                               feature.cam_state_indices.end(), cam_id);
-            if (cam_it != feature.cam_state_indices.end()) {
-              feature.cam_state_indices.erase(cam_it);
-              feature.observations.erase(
-                feature.observations.begin() +
-                distance(feature.cam_state_indices.begin(), cam_it));
-            }
-          }
+          removeObservations(feature, is_removed);
         }
 
-        H_x.conservativeResize(stack_counter, H_x.cols());
-        r_x.conservativeResize(stack_counter);
-        R_x.conservativeResize(stack_counter, stack_counter);
-
         // Perform Measurement Update
-        measurementUpdate(H_x, r_x, R_x);
+        measurementUpdate(H_x.topRows(stack_counter), r_x.head(stack_counter),
+                          noise_params_.u_var_prime);
 
         // Time to prune
-        std::vector<size_t> deleteIdx(0);
-
-        size_t num_states = cam_states_.size();
-
-        // Find all cam states which are marked for deletion
-        auto cam_state_it = cam_states_.begin();
-        size_t num_deleted = 0;
-        int cam_state_pos = 0;
-
-        while (cam_state_it != cam_states_.end()) {
-          if (find(rm_cam_state_ids.begin(), rm_cam_state_ids.end(),
-                   cam_state_it->state_id) != rm_cam_state_ids.end()) {
-            // TODO: add to pruned states? If yes, maybe sort states by state id
-            deleteIdx.push_back(cam_state_pos + num_deleted);
-            pruned_states_.push_back(*cam_state_it);
-            cam_state_it = cam_states_.erase(cam_state_it);
-            ++num_deleted;
-          } else {
-            ++cam_state_it;
-            ++cam_state_pos;
-          }
+        if (rm_cam_state_ids.empty()) {
+          return;
         }
 
-        if (num_deleted != 0) {
-          int n_remove = 0;
-          int n_keep = 0;
-          std::vector<bool> to_keep(num_states, false);
-          for (size_t IDx = 0; IDx < num_states; ++IDx) {
-            if (find(deleteIdx.begin(), deleteIdx.end(), IDx) != deleteIdx.end())
-              ++n_remove;
-            else {
-              to_keep[IDx] = true;
-              ++n_keep;
-            }
-          }
-
-          int remove_counter = 0;
-          int keep_counter = 0;
-          VectorXi keepCovarIdx(6 * n_keep);
-          VectorXi removeCovarIdx(6 * n_remove);
-
-          for (size_t IDx = 0; IDx < num_states; ++IDx) {
-            if (!to_keep[IDx]) {
-              removeCovarIdx.segment<6>(6 * remove_counter) =
-                VectorXi::LinSpaced(6, 6 * IDx, 6 * (IDx + 1) - 1);
-              ++remove_counter;
-            } else {
-              keepCovarIdx.segment<6>(6 * keep_counter) =
-                VectorXi::LinSpaced(6, 6 * IDx, 6 * (IDx + 1) - 1);
-              ++keep_counter;
-            }
-          }
-
-          MatrixX<_S> prunedCamCovar;
-          square_slice(cam_covar_, keepCovarIdx, prunedCamCovar);
-
-          cam_covar_.resize(prunedCamCovar.rows(), prunedCamCovar.cols());
-          cam_covar_ = prunedCamCovar;
-
-          Matrix<_S, 15, Dynamic> prunedImuCamCovar;
-          column_slice(imu_cam_covar_, keepCovarIdx, prunedImuCamCovar);
-
-          imu_cam_covar_.resize(prunedImuCamCovar.rows(), prunedImuCamCovar.cols());
-          imu_cam_covar_ = prunedImuCamCovar;
-        }
+        removeCamStates(to_keep);
       }
 
       // Removes camera states that no longer contain any active observations.
       void pruneEmptyStates() {
+        applyPendingPropagation();
+
         int max_states = msckf_params_.max_cam_states;
         if (cam_states_.size() < max_states) return;
-        std::vector<size_t> deleteIdx;
-        deleteIdx.clear();
-
-        size_t num_states = cam_states_.size();
 
         // Find all cam_states_ with no tracked landmarks and prune them
-        auto camState_it = cam_states_.begin();
-        size_t num_deleted = 0;
-        int camstate_pos = 0;
         int num_cam_states = cam_states_.size();
 
         int last_to_remove = num_cam_states - max_states-1;
@@ -709,52 +756,12 @@ namespace msckf_mono {
           }
         }
 
+        if (last_to_remove < 0) return;
+        std::vector<bool> &to_keep = resetCamStateKeepFlags();
         for (int i = 0; i <= last_to_remove; ++i) {
-          deleteIdx.push_back(camstate_pos + num_deleted);
-          pruned_states_.push_back(*camState_it);
-          camState_it = cam_states_.erase(camState_it);
-          num_deleted++;
-        }
-
-        if (deleteIdx.size() != 0) {
-          int n_remove = 0;
-          int n_keep = 0;
-          std::vector<bool> to_keep(num_states, false);
-          for (size_t IDx = 0; IDx < num_states; IDx++) {
-            if (find(deleteIdx.begin(), deleteIdx.end(), IDx) != deleteIdx.end())
-              n_remove++;
-            else {
-              to_keep[IDx] = true;
-              n_keep++;
-            }
-          }
-
-          int remove_counter = 0;
-          int keep_counter = 0;
-          VectorXi keepCovarIdx(6 * n_keep);
-          VectorXi removeCovarIdx(6 * n_remove);
-          for (size_t IDx = 0; IDx < num_states; IDx++) {
-            if (!to_keep[IDx]) {
-              removeCovarIdx.segment<6>(6 * remove_counter) =
-                VectorXi::LinSpaced(6, 6 * IDx, 6 * (IDx + 1) - 1);
-              remove_counter++;
-            } else {
-              keepCovarIdx.segment<6>(6 * keep_counter) =
-                VectorXi::LinSpaced(6, 6 * IDx, 6 * (IDx + 1) - 1);
-              keep_counter++;
-            }
-          }
-
-          MatrixX<_S> prunedCamCovar;
-          square_slice(cam_covar_, keepCovarIdx, prunedCamCovar);
-          cam_covar_.resize(prunedCamCovar.rows(), prunedCamCovar.cols());
-          cam_covar_ = prunedCamCovar;
-
-          Matrix<_S, 15, Dynamic> prunedImuCamCovar;
-          column_slice(imu_cam_covar_, keepCovarIdx, prunedImuCamCovar);
-          imu_cam_covar_.resize(prunedImuCamCovar.rows(), prunedImuCamCovar.cols());
-          imu_cam_covar_ = prunedImuCamCovar;
+          to_keep[i] = false;
         }
+        removeCamStates(to_keep);
 
         // TODO: Additional outputs = deletedCamCovar (used to compute sigma),
         // deletedCamStates
@@ -763,42 +770,14 @@ namespace msckf_mono {
       // Once all images are processed, this method will marginalize any remaining feature tracks
       // and update the final state.
       void finish() {
-        for (size_t i = 0; i < tracked_feature_ids_.size(); i++) {
-          std::vector<size_t> camStateIndices;
-          std::vector<camState<_S>> camStatesTemp;
-          removeTrackedFeature(tracked_feature_ids_[i], camStatesTemp,
-                               camStateIndices);
-
-          if (camStatesTemp.size() >= msckf_params_.min_track_length) {
-            featureTrackToResidualize<_S> track;
-
-            if (feature_tracks_[i].feature_id != tracked_feature_ids_[i]) {
-              for (typename std::vector<featureTrack<_S>>::iterator feat_track =
-                   feature_tracks_.begin();
-                   feat_track != feature_tracks_.end(); feat_track++) {
-                if (feat_track->feature_id == tracked_feature_ids_[i]) {
-                  track.feature_id = feat_track->feature_id;
-                  track.observations = feat_track->observations;
-                  track.initialized = feat_track->initialized;
-                  if (feat_track->initialized) track.p_f_G = feat_track->p_f_G;
-                  break;
-                }
-              }
-            } else {
-              track.feature_id = feature_tracks_[i].feature_id;
-              track.observations = feature_tracks_[i].observations;
-              track.initialized = feature_tracks_[i].initialized;
-              if (feature_tracks_[i].initialized)
-                track.p_f_G = feature_tracks_[i].p_f_G;
-            }
-
-            track.cam_states = camStatesTemp;
-            track.cam_state_indices = camStateIndices;
-
-            feature_tracks_to_residualize_.push_back(track);
-          }
-
-          tracks_to_remove_.push_back(tracked_feature_ids_[i]);
+        // Tracks left from the last update() were already marginalized, and
+        // their camera slots may have been pruned since
+        feature_tracks_to_residualize_.clear();
+        residual_obs_.clear();
+        for (size_t slot : active_track_slots_) {
+          const featureTrack<_S> &feature = track_slots_[slot];
+          residualizeTrack(feature);
+          append(tracks_to_remove_, feature.feature_id);
         }
 
         marginalize();
@@ -817,6 +796,112 @@ namespace msckf_mono {
         return imu_state_;
       }
 
+      inline Matrix<_S, 15, 15> getImuCovar()
+      {
+        return imuCovar();
+      }
+
+      // Full [IMU, camera states] covariance
+      inline MatrixX<_S> getCovar()
+      {
+        applyPendingPropagation();
+        return covar();
+      }
+
+      // Triangulates the tracked features feature_ids from all their current
+      // observations, on num_threads workers when built with OpenMP. The
+      // camera state rotations are shared by all tracks and each track's
+      // triangulation cache is used and refreshed. out_points[i] is the world
+      // position of feature_ids[i]; out_valid[i] is false if the feature is
+      // not tracked, has fewer than two observations or failed to
+      // triangulate. A repeated id is solved once and copied. Apart from the
+      // triangulation caches, the filter state is not changed.
+      void triangulateBatch(const std::vector<size_t> &feature_ids,
+                            std::vector<Vector3<_S>, Eigen::aligned_allocator<Vector3<_S>>> &out_points,
+                            std::vector<bool> &out_valid) {
+        const size_t num_tracks = feature_ids.size();
+        out_points.assign(num_tracks, Vector3<_S>::Zero());
+        out_valid.assign(num_tracks, false);
+        if (num_tracks == 0) return;
+
+        const ScratchArena::Mark mark = scratch_.mark();
+        triangulationJob<_S> *jobs = scratch_.allocate<triangulationJob<_S>>(num_tracks);
+        // Jobs sharing a track would share its cache across workers, so only
+        // the first job of each slot is solved and the others copy it
+        size_t *first_job = scratch_.allocate<size_t>(track_slots_.size());
+        size_t *source_job = scratch_.allocate<size_t>(num_tracks);
+        std::fill(first_job, first_job + track_slots_.size(), num_tracks);
+        batch_obs_.clear();
+        for (size_t i = 0; i < num_tracks; i++) {
+          jobs[i] = {batch_obs_.size(), 0, nullptr};
+          source_job[i] = i;
+          const size_t slot = track_slot_by_id_.find(feature_ids[i]);
+          if (slot == IdIndexMap::npos) continue;
+          if (first_job[slot] != num_tracks) {
+            source_job[i] = first_job[slot];
+            continue;
+          }
+          first_job[slot] = i;
+          featureTrack<_S> &track = track_slots_[slot];
+          if (track.cam_state_indices.size() < 2) continue;
+
+          for (size_t j = 0; j < track.cam_state_indices.size(); j++) {
+            appendObservation(batch_obs_, track.observations[j],
+                              camStatePosition(track.cam_state_indices[j]));
+          }
+          jobs[i].num_obs = track.cam_state_indices.size();
+          jobs[i].cache = &track.triangulation;
+        }
+
+        auto points = scratch_.matrix<_S>(3, num_tracks);
+        char *valid = scratch_.allocate<char>(num_tracks);
+        triangulateTracks(batch_obs_, jobs, num_tracks, points, valid);
+        for (size_t i = 0; i < num_tracks; i++) {
+          const size_t source = source_job[i];
+          out_valid[i] = valid[source];
+          if (valid[source]) out_points[i] = points.col(source);
+        }
+        scratch_.rewind(mark);
+      }
+
+      // Measurement updates skipped because the innovation covariance was
+      // not positive definite, even with the LDLT fallback.
+      inline size_t getNumSkippedUpdates() const
+      {
+        return num_skipped_updates_;
+      }
+
+      // Feature triangulations answered from the per-track cache, and those
+      // that ran the solver.
+      inline size_t getTriangulationCacheHits() const
+      {
+        return triangulation_cache_hits_;
+      }
+
+      inline size_t getTriangulationCacheMisses() const
+      {
+        return triangulation_cache_misses_;
+      }
+
+      // Heap allocations made by the filter so far: scratch arena blocks,
+      // growth of the track, observation, camera state and id lookup
+      // storage and of the covariance, and LDLT fallbacks in the gating test
+      // and the measurement update. It stops changing once the filter has
+      // seen its largest frame and window, unless a fallback runs or
+      // keep_pruned_states grows the pruned state record. Copies returned by
+      // the getters are made by the caller and not counted, and neither are
+      // Eigen's product buffers, which come from the heap only above
+      // EIGEN_STACK_ALLOCATION_LIMIT bytes (raised in CMakeLists.txt).
+      inline size_t getHeapAllocations() const
+      {
+        size_t num_allocations = heap_allocations_ + scratch_.blockAllocations() +
+          track_slot_by_id_.growths() + cam_state_positions_.growths();
+        for (const auto &scratch : worker_scratch_) {
+          num_allocations += scratch.blockAllocations();
+        }
+        return num_allocations;
+      }
+
       inline std::vector<Vector3<_S>, Eigen::aligned_allocator<Vector3<_S>>> getMap()
       {
         return map_;
@@ -832,12 +917,12 @@ namespace msckf_mono {
         return cam_states_[i];
       }
 
-      inline std::vector<camState<_S>> getCamStates() const
+      inline camStateVector<_S> getCamStates() const
       {
         return cam_states_;
       }
 
-      inline std::vector<camState<_S>> getPrunedStates()
+      inline camStateVector<_S> getPrunedStates()
       {
         std::sort(pruned_states_.begin(), pruned_states_.end(),
                   [](camState<_S> a, camState<_S> b)
@@ -871,6 +956,112 @@ namespace msckf_mono {
         return updateQuat;
       }
 
+      // The whole covariance buffer, with leading dimension covar_capacity_
+      inline CovarMap covarBuffer() {
+        return CovarMap(covar_storage_.data(), covar_capacity_, covar_capacity_);
+      }
+
+      // Views of the live covariance and its IMU, IMU-camera and camera blocks.
+      inline Block<CovarMap> covar() {
+        return covarBuffer().topLeftCorner(covar_dim_, covar_dim_);
+      }
+
+      inline Block<CovarMap, 15, 15> imuCovar() {
+        return covarBuffer().template topLeftCorner<15, 15>();
+      }
+
+      inline Block<CovarMap, 15, Dynamic> imuCamCovar() {
+        return covarBuffer().template block<15, Dynamic>(0, 15, 15, covar_dim_ - 15);
+      }
+
+      inline Block<CovarMap> camCovar() {
+        return covarBuffer().block(15, 15, covar_dim_ - 15, covar_dim_ - 15);
+      }
+
+      // Makes room for num_cam_states camera states in the covariance buffer
+      // and the scratch buffers sized with it. Only reallocates when growing.
+      // A fixed-capacity filter takes its whole buffer on first use and
+      // cannot grow.
+      void reserveCovar(size_t num_cam_states) {
+        size_t capacity = 15 + 6 * num_cam_states;
+        if (MaxCovarDim != Dynamic) {
+          if (capacity > static_cast<size_t>(MaxCovarDim)) {
+            throw std::runtime_error("MSCKF: camera state window exceeds MaxCamStates");
+          }
+          capacity = MaxCovarDim;
+        }
+        if (capacity <= covar_capacity_) {
+          return;
+        }
+
+        growCovarStorage(covar_storage_, capacity);
+        covar_capacity_ = capacity;
+        imu_cam_covar_tmp_.resize(15, capacity - 15);
+        if (_MaxCamStates == Dynamic) heap_allocations_++;
+      }
+
+      // Moves the live covariance into a buffer with leading dimension
+      // capacity.
+      void growCovarStorage(std::vector<_S, Eigen::aligned_allocator<_S>> &storage,
+                            size_t capacity) {
+        std::vector<_S, Eigen::aligned_allocator<_S>> grown(capacity * capacity);
+        if (covar_capacity_ != 0) {
+          CovarMap(grown.data(), capacity, capacity).topLeftCorner(covar_dim_, covar_dim_) =
+            covar();
+        }
+        storage.swap(grown);
+      }
+
+      // A fixed buffer is only ever taken whole, before it holds anything
+      template <size_t _N>
+        void growCovarStorage(std::array<_S, _N> &, size_t) {}
+
+      // Drops the rows and columns of the camera states with to_keep[i] false by
+      // moving the kept 6-wide blocks down in the buffer. Kept blocks only ever
+      // move to a lower index, so the moves never overlap.
+      void removeCamStatesFromCovar(const std::vector<bool>& to_keep) {
+        auto covar_buffer = covarBuffer();
+        size_t dst = 15;
+        for (size_t i = 0; i < to_keep.size(); ++i) {
+          if (!to_keep[i]) continue;
+          const size_t src = 15 + 6 * i;
+          if (src != dst) {
+            covar_buffer.block(0, dst, covar_dim_, 6) = covar_buffer.block(0, src, covar_dim_, 6);
+          }
+          dst += 6;
+        }
+
+        const size_t new_dim = dst;
+        dst = 15;
+        for (size_t i = 0; i < to_keep.size(); ++i) {
+          if (!to_keep[i]) continue;
+          const size_t src = 15 + 6 * i;
+          if (src != dst) {
+            covar_buffer.block(dst, 0, 6, new_dim) = covar_buffer.block(src, 0, 6, new_dim);
+          }
+          dst += 6;
+        }
+
+        covar_dim_ = new_dim;
+      }
+
+      // Brings imuCamCovar() up to date with the IMU samples propagated since
+      // the last call.
+      void applyPendingPropagation() {
+        if (!propagation_pending_) {
+          return;
+        }
+
+        const size_t n = covar_dim_ - 15;
+        auto imu_cam_covar_tmp = imu_cam_covar_tmp_.leftCols(n);
+        blockSparseProduct<PhiBlockMask>(Phi_accum_, imuCamCovar(), imu_cam_covar_tmp);
+        imuCamCovar() = imu_cam_covar_tmp;
+        covarBuffer().block(15, 0, n, 15) = imu_cam_covar_tmp.transpose();
+
+        Phi_accum_.setIdentity();
+        propagation_pending_ = false;
+      }
+
       inline void calcF(const imuState<_S> &imu_state_k,
                         const imuReading<_S> &measurement_k) {
         /* Multiplies the error state in the linearized continuous-time
@@ -889,33 +1080,135 @@ namespace msckf_mono {
         F_.template block<3, 3>(12, 6) = Matrix3<_S>::Identity();
       }
 
-      inline void calcG(const imuState<_S> &imu_state_k) {
-        /* Multiplies the noise std::vector in the linearized continuous-time
-           error state model */
-        G_.setZero();
+      inline void calcPhiClosedForm(const _S &dT) {
+        /* Analytic exp(F * dT) for the block structure produced by calcF.
+           With W = skew(omegaHat), A = -C_IG^T skew(aHat) and B = -C_IG^T,
+           every non-trivial block is a polynomial in W whose coefficients
+           are the iterated integrals of exp(-W t):
+             c_k = sum_j (-1)^j |w|^(2j) dT^(k+2j) / (k+2j)!  */
+        const Matrix3<_S> W = -F_.template block<3, 3>(0, 0);
+        const Matrix3<_S> A = F_.template block<3, 3>(6, 0);
+        const Matrix3<_S> B = F_.template block<3, 3>(6, 9);
+        const Matrix3<_S> W2 = W * W;
+        const Matrix3<_S> I = Matrix3<_S>::Identity();
+
+        const _S w_sq = W(2, 1) * W(2, 1) + W(0, 2) * W(0, 2) + W(1, 0) * W(1, 0);
+        const _S w_norm = std::sqrt(w_sq);
+        const _S theta = w_norm * dT;
+
+        _S c[6];
+        if (theta < 1) {
+          // Truncated series, avoids the cancellation in the trig forms
+          const _S theta_sq = theta * theta;
+          _S dT_k = 1;
+          _S k_fact = 1;
+          for (int k = 0; k < 6; ++k) {
+            _S term = 1 / k_fact;
+            _S sum = term;
+            for (int j = 1; j < 6; ++j) {
+              term *= -theta_sq / ((k + 2 * j - 1) * (k + 2 * j));
+              sum += term;
+            }
+            c[k] = dT_k * sum;
+            dT_k *= dT;
+            k_fact *= (k + 1);
+          }
+        } else {
+          const _S s = std::sin(theta);
+          const _S co = std::cos(theta);
+          c[0] = co;
+          c[1] = s / w_norm;
+          c[2] = (1 - co) / w_sq;
+          c[3] = (theta - s) / (w_sq * w_norm);
+          c[4] = (theta * theta / 2 - 1 + co) / (w_sq * w_sq);
+          c[5] = (theta * theta * theta / 6 - theta + s) / (w_sq * w_sq * w_norm);
+        }
 
-        Matrix3<_S> C_IG = imu_state_k.q_IG.toRotationMatrix();
+        // Gamma_n = integral of Gamma_(n-1), Gamma_0 = exp(-W dT)
+        const Matrix3<_S> Gamma0 = I - c[1] * W + c[2] * W2;
+        const Matrix3<_S> Gamma1 = dT * I - c[2] * W + c[3] * W2;
+        const Matrix3<_S> Gamma2 = (dT * dT / 2) * I - c[3] * W + c[4] * W2;
+        const Matrix3<_S> Gamma3 = (dT * dT * dT / 6) * I - c[4] * W + c[5] * W2;
+
+        Phi_.setIdentity();
+        Phi_.template block<3, 3>(0, 0) = Gamma0;
+        Phi_.template block<3, 3>(0, 3) = -Gamma1;
+        Phi_.template block<3, 3>(6, 0) = A * Gamma1;
+        Phi_.template block<3, 3>(6, 3) = -A * Gamma2;
+        Phi_.template block<3, 3>(6, 9) = B * dT;
+        Phi_.template block<3, 3>(12, 0) = A * Gamma2;
+        Phi_.template block<3, 3>(12, 3) = -A * Gamma3;
+        Phi_.template block<3, 3>(12, 6) = I * dT;
+        Phi_.template block<3, 3>(12, 9) = B * (dT * dT / 2);
+      }
+
+      void initGQGt() {
+        /* G multiplies the noise std::vector in the linearized continuous-time
+           error state model and is block diagonal: -I, I, -C_IG^T, I, with no
+           noise entering the position. Only the blocks touching the velocity
+           depend on the orientation, precompute everything else once. */
+        const Matrix<_S, 12, 12> &Q = noise_params_.Q_imu;
+        const _S sign[4] = {-1, 1, -1, 1};
+
+        GQGt_.setZero();
+        for (int i = 0; i < 4; ++i) {
+          for (int j = 0; j < 4; ++j) {
+            GQGt_.template block<3, 3>(3 * i, 3 * j) =
+              sign[i] * sign[j] * Q.template block<3, 3>(3 * i, 3 * j);
+          }
+        }
 
-        G_.template block<3, 3>(0, 0) = -Matrix3<_S>::Identity();
-        G_.template block<3, 3>(3, 3) = Matrix3<_S>::Identity();
-        G_.template block<3, 3>(6, 6) = -C_IG.transpose();
-        G_.template block<3, 3>(9, 9) = Matrix3<_S>::Identity();
+        // Uncorrelated isotropic accelerometer noise is invariant to C_IG
+        const Matrix3<_S> Q_a = Q.template block<3, 3>(6, 6);
+        GQGt_orientation_free_ =
+          (Q_a - Q_a(0, 0) * Matrix3<_S>::Identity()).isZero(0) &&
+          Q.template block<3, 6>(6, 0).isZero(0) &&
+          Q.template block<3, 3>(6, 9).isZero(0);
       }
 
+      inline void calcGQGt(const imuState<_S> &imu_state_k) {
+        if (GQGt_orientation_free_) {
+          return;
+        }
+
+        const Matrix<_S, 12, 12> &Q = noise_params_.Q_imu;
+        const Matrix3<_S> C_IG = imu_state_k.q_IG.toRotationMatrix();
+        const _S sign[4] = {-1, 1, -1, 1};
+
+        for (int j = 0; j < 4; ++j) {
+          Matrix3<_S> block = -C_IG.transpose() * Q.template block<3, 3>(6, 3 * j);
+          if (j == 2) {
+            block = block * -C_IG;
+          } else {
+            block *= sign[j];
+          }
+          GQGt_.template block<3, 3>(6, 3 * j) = block;
+          GQGt_.template block<3, 3>(3 * j, 6) = block.transpose();
+        }
+      }
+
+      // The track is the run [begin, begin + num_obs) of obs, and r_j its
+      // stacked residual from calcResidual. H_x_j (2M x 6M) is compact: only
+      // the 6 columns of each observing camera state, in that order, since
+      // every other column is zero. See scatterCamStateColumns for placing it
+      // in the full state Jacobian.
+      // On return the projected Jacobian H_o_j and residual are the last
+      // 2M - 3 rows of H_x_j and r_j.
       void calcMeasJacobian(const Vector3<_S> &p_f_G,
-                            const std::vector<size_t> &camStateIndices,
-                            MatrixX<_S> &H_o_j,
-                            MatrixX<_S> &A_j) {
+                            const observationArena<_S> &obs, size_t begin, size_t num_obs,
+                            Eigen::Ref<VectorX<_S>> r_j,
+                            Eigen::Ref<MatrixX<_S>> H_x_j,
+                            ScratchArena &scratch) {
         // Calculates H_o_j according to Mourikis 2007
+        const ScratchArena::Mark mark = scratch.mark();
 
-        MatrixX<_S> H_f_j = MatrixX<_S>::Zero(2 * camStateIndices.size(), 3);
-        MatrixX<_S> H_x_j =
-          MatrixX<_S>::Zero(2 * camStateIndices.size(), 15 + 6 * cam_states_.size());
+        auto H_f_j = scratch.matrix<_S>(2 * num_obs, 3);
+        H_f_j.setZero();
+        H_x_j.setZero();
 
-        for (int c_i = 0; c_i < camStateIndices.size(); c_i++) {
-          size_t index = camStateIndices[c_i];
-          Vector3<_S> p_f_C = cam_states_[index].q_CG.toRotationMatrix() *
-            (p_f_G - cam_states_[index].p_C_G);
+        for (int c_i = 0; c_i < num_obs; c_i++) {
+          const camState<_S> &cam = cam_states_[obs.cam_state_slots[begin + c_i]];
+          Vector3<_S> p_f_C = cam.R_CG * (p_f_G - cam.p_C_G);
 
           _S X, Y, Z;
 
@@ -930,63 +1223,83 @@ namespace msckf_mono {
           J_i << 1, 0, -X / Z, 0, 1, -Y / Z;
           J_i *= 1 / Z;
 
-          // Enforce observability constraint, see propagation for citation
-          Matrix<_S, 2, 6> A;
-          A << J_i * vectorToSkewSymmetric(p_f_C),
-            -J_i * cam_states_[index].q_CG.toRotationMatrix();
-
-          Matrix<_S, 6, 1> u = Matrix<_S, 6, 1>::Zero();
-          u.head(3) = cam_states_[index].q_CG.toRotationMatrix() * imu_state_.g;
-          Vector3<_S> tmp = p_f_G - cam_states_[index].p_C_G;
-          u.tail(3) = vectorToSkewSymmetric(tmp) * imu_state_.g;
-
-          Matrix<_S, 2, 6> H_x =
-            A - A * u * (u.transpose() * u).inverse() * u.transpose();
+          // Enforce observability constraint, see propagation for citation.
+          // u = [R_CG g; skew(p_f_G - p_C_G) g], whose rotational half is
+          // cached per camera state, is projected out of the Jacobian.
+          Matrix<_S, 2, 6> H_x;
+          H_x << J_i * vectorToSkewSymmetric(p_f_C),
+            -J_i * cam.R_CG;
+
+          Matrix<_S, 6, 1> u;
+          u.template head<3>() = cam.R_CG_g;
+          u.template tail<3>() = (p_f_G - cam.p_C_G).cross(imu_state_.g);
+          projectOutDirection(H_x, u);
           Matrix<_S, 2, 3> H_f = -H_x.template block<2, 3>(0, 3);
           H_f_j.template block<2, 3>(2 * c_i, 0) = H_f;
 
-          // Potential indexing problem zone
-          H_x_j.template block<2, 6>(2 * c_i, 15 + 6 * (index)) = H_x;
+          H_x_j.template block<2, 6>(2 * c_i, 6 * c_i) = H_x;
         }
 
-        int jacobian_row_size = 2 * camStateIndices.size();
+        int jacobian_row_size = 2 * num_obs;
+
+        // Project onto the left null space of H_f_j. Q^T from a Householder QR
+        // of H_f_j zeroes all but its first 3 rows, so applying the reflectors
+        // to H_x_j and r_j in place leaves the projection in their last
+        // 2M - 3 rows, without an SVD or an explicit null space basis. The
+        // basis differs from the SVD one by a rotation, which leaves the
+        // update unchanged for isotropic pixel noise (R_j = sigma^2 I).
+        auto workspace = scratch.vector<_S>(H_x_j.cols());
+        _S tau, beta;
+        for (int k = 0; k < 3; k++) {
+          const int n = jacobian_row_size - k;
+          H_f_j.col(k).tail(n).makeHouseholderInPlace(tau, beta);
+          const auto essential = H_f_j.col(k).tail(n - 1);
+          if (k < 2) {
+            H_f_j.block(k, k + 1, n, 2 - k).applyHouseholderOnTheLeft(
+              essential, tau, workspace.data());
+          }
+          H_x_j.bottomRows(n).applyHouseholderOnTheLeft(essential, tau, workspace.data());
+          r_j.tail(n).applyHouseholderOnTheLeft(essential, tau, workspace.data());
+        }
 
-        JacobiSVD<MatrixX<_S>> svd_helper(H_f_j, ComputeFullU | ComputeThinV);
-        A_j = svd_helper.matrixU().rightCols(jacobian_row_size - 3);
+        scratch.rewind(mark);
+      }
 
-        H_o_j = A_j.transpose() * H_x_j;
+      // Copies a compact camera-state Jacobian from calcMeasJacobian into rows
+      // [row, row + H_c.rows()) of the full state Jacobian H.
+      void scatterCamStateColumns(const Eigen::Ref<const MatrixX<_S>> &H_c,
+                                  const observationArena<_S> &obs, size_t begin, size_t num_obs,
+                                  int row, Eigen::Ref<MatrixX<_S>> H) {
+        for (size_t c_i = 0; c_i < num_obs; c_i++) {
+          H.block(row, 15 + 6 * obs.cam_state_slots[begin + c_i], H_c.rows(), 6) =
+            H_c.middleCols(6 * c_i, 6);
+        }
       }
 
-      VectorX<_S> calcResidual(const Vector3<_S> &p_f_G,
-                               const std::vector<camState<_S>> &camStates,
-                               const std::vector<Vector2<_S>, Eigen::aligned_allocator<Vector2<_S>>> &observations) {
+      void calcResidual(const Vector3<_S> &p_f_G,
+                        const observationArena<_S> &obs, size_t begin, size_t num_obs,
+                        Eigen::Ref<VectorX<_S>> r_j) {
         // CALCRESIDUAL Calculates the residual for a feature position
 
-        VectorX<_S> r_j = VectorX<_S>::Constant(2 * camStates.size(),
-                                                std::numeric_limits<_S>::quiet_NaN());
-
-        int iter = 0;
-        for (auto state_i : camStates) {
-          Vector3<_S> p_f_C = state_i.q_CG.toRotationMatrix() * (p_f_G - state_i.p_C_G);
+        for (size_t iter = 0; iter < num_obs; iter++) {
+          const camState<_S> &state_i = cam_states_[obs.cam_state_slots[begin + iter]];
+          Vector3<_S> p_f_C = state_i.R_CG * (p_f_G - state_i.p_C_G);
           Vector2<_S> zhat_i_j = p_f_C.template head<2>() / p_f_C(2);
 
-          r_j.template segment<2>(2 * iter) = observations[iter] - zhat_i_j;
-          iter++;
+          r_j.template segment<2>(2 * iter) = obs.observations[begin + iter] - zhat_i_j;
         }
-
-        return r_j;
       }
 
-      bool checkMotion(const Vector2<_S> first_observation,
-                       const std::vector<camState<_S>>& cam_states) {
-        if (cam_states.size() < 2) {
+      bool checkMotion(const observationArena<_S> &obs, size_t begin, size_t num_obs) const {
+        if (num_obs < 2) {
           return false;
         }
-        const camState<_S> &first_cam = cam_states.front();
+        const Vector2<_S> &first_observation = obs.observations[begin];
+        const camState<_S> &first_cam = cam_states_[obs.cam_state_slots[begin]];
         // const camState<_S>& last_cam = cam_states.back();
 
         Isometry3<_S> first_cam_pose;
-        first_cam_pose.linear() = first_cam.q_CG.toRotationMatrix().transpose();
+        first_cam_pose.linear() = first_cam.R_CG.transpose();
         first_cam_pose.translation() = first_cam.p_C_G;
         // Get the direction of the feature when it is first observed.
         // This direction is represented in the world frame.
@@ -997,18 +1310,13 @@ namespace msckf_mono {
 
         _S max_ortho_translation = 0;
 
-        for (auto second_cam_iter = cam_states.begin() + 1;
-             second_cam_iter != cam_states.end(); second_cam_iter++) {
-          Isometry3<_S> second_cam_pose;
-          second_cam_pose.linear() =
-            second_cam_iter->q_CG.toRotationMatrix().transpose();
-          second_cam_pose.translation() = second_cam_iter->p_C_G;
+        for (size_t i = 1; i < num_obs; i++) {
+          const camState<_S> &second_cam = cam_states_[obs.cam_state_slots[begin + i]];
           // Compute the translation between the first frame
           // and the last frame. We assume the first frame and
           // the last frame will provide the largest motion to
           // speed up the checking process.
-          Vector3<_S> translation =
-            second_cam_pose.translation() - first_cam_pose.translation();
+          Vector3<_S> translation = second_cam.p_C_G - first_cam_pose.translation();
           // translation = translation / translation.norm();
           _S parallel_translation = translation.transpose() * feature_direction;
           Vector3<_S> orthogonal_translation =
@@ -1024,28 +1332,6 @@ namespace msckf_mono {
           return false;
       }
 
-      void cost(const Isometry3<_S>& T_c0_ci,
-                const Vector3<_S>& x, const Vector2<_S>& z,
-                _S& e) const {
-        // Compute hi1, hi2, and hi3 as Equation (37).
-        const _S &alpha = x(0);
-        const _S &beta = x(1);
-        const _S &rho = x(2);
-
-        Vector3<_S> h = T_c0_ci.linear() * Vector3<_S>(alpha, beta, 1.0) +
-          rho * T_c0_ci.translation();
-        _S &h1 = h(0);
-        _S &h2 = h(1);
-        _S &h3 = h(2);
-
-        // Predict the feature observation in ci frame.
-        Vector2<_S> z_hat(h1 / h3, h2 / h3);
-
-        // Compute the residual.
-        e = (z_hat - z).squaredNorm();
-        return;
-      }
-
       void findRedundantCamStates(std::vector<size_t> &rm_cam_state_ids) {
         // Ensure that there are enough cam_states to work with
         if (cam_states_.size() < 5) return;
@@ -1069,7 +1355,7 @@ namespace msckf_mono {
           _S distance = (cam_pos-kf_pos).norm();
           _S angle = kf_q.angularDistance(cam_q);
           if(distance<dist_thresh&&angle<angle_thresh){
-            rm_cam_state_ids.push_back(next_cs->state_id);
+            append(rm_cam_state_ids, next_cs->state_id);
           }else{
             last_kf = next_cs;
             kf_pos = last_kf->p_C_G;
@@ -1085,7 +1371,7 @@ namespace msckf_mono {
         int num_over_max = (cam_states_.size() - rm_cam_state_ids.size()) - msckf_params_.max_cam_states;
         for(int i=0; i<num_over_max; i++){
           if(rm_cam_state_ids.end() == std::find(rm_cam_state_ids.begin(), rm_cam_state_ids.end(), cam_states_[i].state_id)){
-            rm_cam_state_ids.push_back(cam_states_[i].state_id);
+            append(rm_cam_state_ids, cam_states_[i].state_id);
           }
         }
 
@@ -1100,19 +1386,47 @@ namespace msckf_mono {
 
       // Constraint on track to be marginalized based on Mahalanobis Gating
       // High Precision, Consistent EKF-based Visual-Inertial Odometry by Li et al.
-      bool gatingTest(const MatrixX<_S>& H, const VectorX<_S>& r, const int& dof) {
-        MatrixX<_S> P = MatrixX<_S>::Zero(15 + cam_covar_.rows(), 15 + cam_covar_.cols());
-        P.template block<15, 15>(0, 0) = imu_covar_;
-        if (cam_covar_.rows() != 0) {
-          P.block(0, 15, 15, imu_cam_covar_.cols()) = imu_cam_covar_;
-          P.block(15, 0, imu_cam_covar_.cols(), 15) = imu_cam_covar_.transpose();
-          P.block(15, 15, cam_covar_.rows(), cam_covar_.cols()) = cam_covar_;
+      // H is the compact Jacobian from calcMeasJacobian, so H * P * H^T only
+      // needs the camera blocks of P for the states observing the track.
+      bool gatingTest(const Eigen::Ref<const MatrixX<_S>>& H,
+                      const observationArena<_S> &obs, size_t begin, size_t num_obs,
+                      const Eigen::Ref<const VectorX<_S>>& r, const int& dof,
+                      ScratchArena &scratch) {
+        const ScratchArena::Mark mark = scratch.mark();
+        const size_t M = num_obs;
+        const size_t *positions = &obs.cam_state_slots[begin];
+        const auto covar_buffer = covarBuffer();
+        auto P_sub = scratch.matrix<_S>(6 * M, 6 * M);
+        for (size_t i = 0; i < M; i++) {
+          for (size_t j = 0; j < M; j++) {
+            P_sub.template block<6, 6>(6 * i, 6 * j) = covar_buffer.template block<6, 6>(
+              15 + 6 * positions[i], 15 + 6 * positions[j]);
+          }
         }
 
-        MatrixX<_S> P1 = H * P * H.transpose();
-        MatrixX<_S> P2 =
-          noise_params_.u_var_prime * MatrixX<_S>::Identity(H.rows(), H.rows());
-        _S gamma = r.transpose() * (P1 + P2).ldlt().solve(r);
+        // gamma = r^T * S^-1 * r = |L^-1 * r|^2 with S = L * L^T
+        auto HP = scratch.matrix<_S>(H.rows(), 6 * M);
+        HP.noalias() = H * P_sub;
+        auto S = scratch.matrix<_S>(H.rows(), H.rows());
+        S.noalias() = HP * H.transpose();
+        S.diagonal().array() += noise_params_.u_var_prime;
+        auto Linv_r = scratch.vector<_S>(H.rows());
+        Linv_r = r;
+        Eigen::LLT<Eigen::Ref<MatrixX<_S>>> llt(S);
+        _S gamma;
+        if (llt.info() == Eigen::Success) {
+          llt.matrixL().solveInPlace(Linv_r);
+          gamma = Linv_r.squaredNorm();
+        } else {
+          S.noalias() = HP * H.transpose();
+          S.diagonal().array() += noise_params_.u_var_prime;
+          gamma = r.dot(S.ldlt().solve(r));
+#ifdef _OPENMP
+          #pragma omp atomic
+#endif
+          heap_allocations_++;
+        }
+        scratch.rewind(mark);
 
         if (gamma < chi_squared_test_table[dof+1]) {
           // cout << "passed" << endl;
@@ -1123,6 +1437,104 @@ namespace msckf_mono {
         }
       }
 
+      // Columns of the structure-of-arrays pose table the triangulation
+      // kernels work on. Row i holds the pose of the i-th observing camera
+      // relative to the first one, T_ci_c0 = [R | T], and the observation z.
+      // Keeping each quantity contiguous over all observations lets Eigen
+      // evaluate the cost and normal equations a full SIMD packet of
+      // observations at a time.
+      enum TriangulationColumn {
+        R00, R10, R20, R01, R11, R21, R02, R12, R22, T0, T1, T2, ZU, ZV,
+        NumTriangulationColumns
+      };
+
+      // poses - num_obs x NumTriangulationColumns
+      // T_c0_w is set to the pose of the first camera in the world frame.
+      void packTriangulationPoses(const observationArena<_S> &obs, size_t begin, size_t num_obs,
+                                  Eigen::Ref<MatrixX<_S>> poses, Isometry3<_S> &T_c0_w) const {
+        const camState<_S> &cam0 = cam_states_[obs.cam_state_slots[begin]];
+        const Matrix3<_S> &R_C0G = cam0.R_CG;
+        T_c0_w.setIdentity();
+        T_c0_w.linear() = R_C0G.transpose();
+        T_c0_w.translation() = cam0.p_C_G;
+
+        for (size_t i = 0; i < num_obs; i++) {
+          const camState<_S> &cam = cam_states_[obs.cam_state_slots[begin + i]];
+          const Matrix3<_S> &R_CiG = cam.R_CG;
+          const Matrix3<_S> R = R_CiG * R_C0G.transpose();
+          const Vector3<_S> t = R_CiG * (cam0.p_C_G - cam.p_C_G);
+          for (int k = 0; k < 9; k++) poses(i, R00 + k) = R(k);
+          for (int k = 0; k < 3; k++) poses(i, T0 + k) = t(k);
+          poses(i, ZU) = obs.observations[begin + i](0);
+          poses(i, ZV) = obs.observations[begin + i](1);
+        }
+      }
+
+      // Sum of squared reprojection errors of the inverse depth point
+      // x = (alpha, beta, rho) in the first camera frame.
+      _S triangulationCost(const Eigen::Ref<const MatrixX<_S>> &poses,
+                           const Vector3<_S> &x) const {
+        // h = R * (alpha, beta, 1) + rho * T, Equation (37)
+        const auto h1 = poses.col(R00).array() * x(0) + poses.col(R01).array() * x(1) +
+          poses.col(R02).array() + poses.col(T0).array() * x(2);
+        const auto h2 = poses.col(R10).array() * x(0) + poses.col(R11).array() * x(1) +
+          poses.col(R12).array() + poses.col(T1).array() * x(2);
+        const auto h3 = poses.col(R20).array() * x(0) + poses.col(R21).array() * x(1) +
+          poses.col(R22).array() + poses.col(T2).array() * x(2);
+        return ((h1 / h3 - poses.col(ZU).array()).square() +
+                (h2 / h3 - poses.col(ZV).array()).square()).sum();
+      }
+
+      // Huber weighted Gauss-Newton normal equations A * delta = b at x, with
+      // A = J^T W^2 J and b = J^T W^2 r over all observations.
+      void triangulationNormalEquations(const Eigen::Ref<const MatrixX<_S>> &poses,
+                                        const Vector3<_S> &x, Matrix3<_S> &A, Vector3<_S> &b,
+                                        ScratchArena &scratch) const {
+        const Eigen::Index n = poses.rows();
+        const ScratchArena::Mark mark = scratch.mark();
+        const _S huber_epsilon = 0.01;
+
+        // Predicted observation and residual
+        auto inv_h3 = scratch.vector<_S>(n);
+        inv_h3.array() = (poses.col(R20).array() * x(0) + poses.col(R21).array() * x(1) +
+                          poses.col(R22).array() + poses.col(T2).array() * x(2)).inverse();
+        auto u = scratch.vector<_S>(n);
+        u.array() = (poses.col(R00).array() * x(0) + poses.col(R01).array() * x(1) +
+                     poses.col(R02).array() + poses.col(T0).array() * x(2)) * inv_h3.array();
+        auto v = scratch.vector<_S>(n);
+        v.array() = (poses.col(R10).array() * x(0) + poses.col(R11).array() * x(1) +
+                     poses.col(R12).array() + poses.col(T1).array() * x(2)) * inv_h3.array();
+
+        // Weighted residuals, u-rows stacked over v-rows
+        auto r = scratch.vector<_S>(2 * n);
+        r.head(n).array() = u.array() - poses.col(ZU).array();
+        r.tail(n).array() = v.array() - poses.col(ZV).array();
+        auto w = scratch.vector<_S>(n);
+        w.array() = (r.head(n).array().square() + r.tail(n).array().square()).sqrt();
+        w.array() = (w.array() <= huber_epsilon).select(_S(1), huber_epsilon / (2 * w.array()));
+        r.head(n).array() *= w.array();
+        r.tail(n).array() *= w.array();
+
+        // Weighted Jacobian rows w / h3 * (W_0 - u * W_2) and
+        // w / h3 * (W_1 - v * W_2), with W = [R.col(0), R.col(1), T]
+        inv_h3.array() *= w.array();
+        auto J = scratch.matrix<_S>(2 * n, 3);
+        const int W_cols[3][3] = {{R00, R10, R20}, {R01, R11, R21}, {T0, T1, T2}};
+        for (int k = 0; k < 3; k++) {
+          J.col(k).head(n).array() = inv_h3.array() *
+            (poses.col(W_cols[k][0]).array() - u.array() * poses.col(W_cols[k][2]).array());
+          J.col(k).tail(n).array() = inv_h3.array() *
+            (poses.col(W_cols[k][1]).array() - v.array() * poses.col(W_cols[k][2]).array());
+        }
+
+        // Too small for a GEMM to pay off, so form the products from dots
+        for (int i = 0; i < 3; i++) {
+          for (int j = i; j < 3; j++) A(i, j) = A(j, i) = J.col(i).dot(J.col(j));
+          b(i) = J.col(i).dot(r);
+        }
+        scratch.rewind(mark);
+      }
+
       void generateInitialGuess(const Isometry3<_S>& T_c1_c2, const Vector2<_S>& z1,
                                 const Vector2<_S>& z2, Vector3<_S>& p) const {
         // Construct a least square problem to solve the depth.
@@ -1144,33 +1556,90 @@ namespace msckf_mono {
         return;
       }
 
-      bool initializePosition(const std::vector<camState<_S>> &camStates,
-                              const std::vector<Vector2<_S>, Eigen::aligned_allocator<Vector2<_S>>> &measurements,
-                              Vector3<_S> &p_f_G) {
-        // Organize camera poses and feature observations properly.
-        std::vector<Isometry3<_S>, Eigen::aligned_allocator<Isometry3<_S>>>
-          cam_poses(0);
+      // Triangulates the tracks described by jobs, whose observations are in
+      // obs, on num_threads workers. Track i's world position is written to
+      // points.col(i) and valid[i] says whether it was accepted; skipped jobs
+      // are not valid.
+      //
+      // points - 3 x num_jobs
+      void triangulateTracks(const observationArena<_S> &obs,
+                             const triangulationJob<_S> *jobs, int num_jobs,
+                             Eigen::Ref<MatrixX<_S>> points, char *valid) {
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic) num_threads(msckf_params_.num_threads)
+#endif
+        for (int i = 0; i < num_jobs; i++) {
+          valid[i] = false;
+          if (jobs[i].num_obs == 0) continue;
+          Vector3<_S> p_f_G;
+          valid[i] = triangulate(obs, jobs[i].obs_begin, jobs[i].num_obs, *jobs[i].cache,
+                                 p_f_G, workerScratch());
+          points.col(i) = p_f_G;
+        }
+      }
 
-        for (auto &cam : camStates) {
-          // This camera pose will take a std::vector from this camera frame
-          // to the world frame.
-          Isometry3<_S> cam0_pose;
-          cam0_pose.linear() = cam.q_CG.toRotationMatrix().transpose();
-          cam0_pose.translation() = cam.p_C_G;
+      // initializePosition behind the track's triangulation cache. The cached
+      // solution is reused while no observation has been added to the track
+      // and no camera state can have moved more than the triangulation
+      // thresholds since it was solved; otherwise it is the starting point of
+      // a new solve. Only valid solutions are cached.
+      bool triangulate(const observationArena<_S> &obs, size_t begin, size_t num_obs,
+                       triangulationCache<_S> &cache, Vector3<_S> &p_f_G,
+                       ScratchArena &scratch) {
+        if (cache.current &&
+            cam_travel_distance_ - cache.travel_distance <=
+            msckf_params_.triangulation_distance_thresh &&
+            cam_travel_angle_ - cache.travel_angle <= msckf_params_.triangulation_angle_thresh) {
+#ifdef _OPENMP
+          #pragma omp atomic
+#endif
+          triangulation_cache_hits_++;
+          p_f_G = cache.p_f_G;
+          return true;
+        }
 
-          cam_poses.push_back(cam0_pose);
+#ifdef _OPENMP
+        #pragma omp atomic
+#endif
+        triangulation_cache_misses_++;
+        const bool valid = initializePosition(obs, begin, num_obs, p_f_G, scratch,
+                                              cache.solved ? &cache.p_f_G : nullptr);
+        if (valid) {
+          cache.solved = true;
+          cache.current = true;
+          cache.p_f_G = p_f_G;
+          cache.travel_distance = cam_travel_distance_;
+          cache.travel_angle = cam_travel_angle_;
         }
+        return valid;
+      }
+
+      // initial_guess, if given, is a previous estimate of p_f_G to start
+      // from instead of the two-view guess.
+      bool initializePosition(const observationArena<_S> &obs, size_t begin, size_t num_obs,
+                              Vector3<_S> &p_f_G, ScratchArena &scratch,
+                              const Vector3<_S> *initial_guess = nullptr) {
+        const ScratchArena::Mark mark = scratch.mark();
 
-        // All camera poses should be modified such that it takes a
-        // std::vector from the first camera frame in the buffer to this
-        // camera frame.
-        Isometry3<_S> T_c0_w = cam_poses[0];
-        for (auto &pose : cam_poses) pose = pose.inverse() * T_c0_w;
+        auto poses = scratch.matrix<_S>(num_obs, NumTriangulationColumns);
+        Isometry3<_S> T_c0_w;
+        packTriangulationPoses(obs, begin, num_obs, poses, T_c0_w);
 
         // Generate initial guess
         Vector3<_S> initial_position(0.0, 0.0, 0.0);
-        generateInitialGuess(cam_poses[cam_poses.size() - 1], measurements[0],
-                             measurements[measurements.size() - 1], initial_position);
+        if (initial_guess) {
+          initial_position = T_c0_w.inverse() * (*initial_guess);
+        }
+        if (!initial_guess || initial_position(2) <= 0) {
+          const size_t last = num_obs - 1;
+          Isometry3<_S> T_c0_cn = Isometry3<_S>::Identity();
+          T_c0_cn.linear() << poses(last, R00), poses(last, R01), poses(last, R02),
+                              poses(last, R10), poses(last, R11), poses(last, R12),
+                              poses(last, R20), poses(last, R21), poses(last, R22);
+          T_c0_cn.translation() << poses(last, T0), poses(last, T1), poses(last, T2);
+          generateInitialGuess(T_c0_cn, obs.observations[begin], obs.observations[begin + last],
+                               initial_position);
+        }
         Vector3<_S> solution(initial_position(0) / initial_position(2),
                              initial_position(1) / initial_position(2),
                              1.0 / initial_position(2));
@@ -1186,34 +1655,13 @@ namespace msckf_mono {
         bool is_cost_reduced = false;
         _S delta_norm = 0;
         // Compute the initial cost.
-        _S total_cost = 0.0;
-        for (int i = 0; i < cam_poses.size(); ++i) {
-          _S this_cost = 0.0;
-          cost(cam_poses[i], solution, measurements[i], this_cost);
-          total_cost += this_cost;
-        }
+        _S total_cost = triangulationCost(poses, solution);
 
         // Outer loop.
         do {
-          Matrix3<_S> A = Matrix3<_S>::Zero();
-          Vector3<_S> b = Vector3<_S>::Zero();
-
-          for (int i = 0; i < cam_poses.size(); ++i) {
-            Matrix<_S, 2, 3> J;
-            Vector2<_S> r;
-            _S w;
-
-            jacobian(cam_poses[i], solution, measurements[i], J, r, w);
-
-            if (w == 1) {
-              A += J.transpose() * J;
-              b += J.transpose() * r;
-            } else {
-              _S w_square = w * w;
-              A += w_square * J.transpose() * J;
-              b += w_square * J.transpose() * r;
-            }
-          }
+          Matrix3<_S> A;
+          Vector3<_S> b;
+          triangulationNormalEquations(poses, solution, A, b, scratch);
 
           // Inner loop.
           // Solve for the delta that can reduce the total cost.
@@ -1223,12 +1671,7 @@ namespace msckf_mono {
             Vector3<_S> new_solution = solution - delta;
             delta_norm = delta.norm();
 
-            _S new_cost = 0.0;
-            for (int i = 0; i < cam_poses.size(); ++i) {
-              _S this_cost = 0.0;
-              cost(cam_poses[i], new_solution, measurements[i], this_cost);
-              new_cost += this_cost;
-            }
+            _S new_cost = triangulationCost(poses, new_solution);
 
             if (new_cost < total_cost) {
               is_cost_reduced = true;
@@ -1254,22 +1697,12 @@ namespace msckf_mono {
 
         // Check if the solution is valid. Make sure the feature
         // is in front of every camera frame observing it.
-        bool is_valid_solution = true;
-        for (const auto &pose : cam_poses) {
-          Vector3<_S> position =
-            pose.linear() * final_position + pose.translation();
-          if (position(2) <= 0) {
-            is_valid_solution = false;
-            break;
-          }
-        }
+        bool is_valid_solution =
+          (poses.col(R20).array() * final_position(0) + poses.col(R21).array() * final_position(1) +
+           poses.col(R22).array() * final_position(2) + poses.col(T2).array() > 0).all();
 
         _S normalized_cost =
-          total_cost / (2 * cam_poses.size() * cam_poses.size());
-
-        VectorX<_S> cov_diag = imu_covar_.diagonal();
-
-        _S pos_covar = cov_diag.segment(12, 3).norm();
+          total_cost / (2 * num_obs * num_obs);
 
         if (normalized_cost > msckf_params_.max_gn_cost_norm) {
           is_valid_solution = false;
@@ -1281,96 +1714,60 @@ namespace msckf_mono {
         // Convert the feature position to the world frame.
         p_f_G = T_c0_w.linear() * final_position + T_c0_w.translation();
 
+        scratch.rewind(mark);
         return is_valid_solution;
       }
 
-      void jacobian(const Isometry3<_S>& T_c0_ci,
-                    const Vector3<_S>& x, const Vector2<_S>& z,
-                    Matrix<_S, 2, 3>& J, Vector2<_S>& r,
-                    _S& w) const {
-        // Compute hi1, hi2, and hi3 as Equation (37).
-        const _S &alpha = x(0);
-        const _S &beta = x(1);
-        const _S &rho = x(2);
-
-        Vector3<_S> h = T_c0_ci.linear() * Vector3<_S>(alpha, beta, 1.0) +
-          rho * T_c0_ci.translation();
-        _S &h1 = h(0);
-        _S &h2 = h(1);
-        _S &h3 = h(2);
-
-        // Compute the Jacobian.
-        Matrix3<_S> W;
-        W.template leftCols<2>() = T_c0_ci.linear().template leftCols<2>();
-        W.template rightCols<1>() = T_c0_ci.translation();
-
-        J.row(0) = 1 / h3 * W.row(0) - h1 / (h3 * h3) * W.row(2);
-        J.row(1) = 1 / h3 * W.row(1) - h2 / (h3 * h3) * W.row(2);
-
-        // Compute the residual.
-        Vector2<_S> z_hat(h1 / h3, h2 / h3);
-        r = z_hat - z;
-
-        // Compute the weight based on the residual.
-        _S e = r.norm();
-        _S huber_epsilon = 0.01;
-        if (e <= huber_epsilon)
-          w = 1.0;
-        else
-          w = huber_epsilon / (2 * e);
-
-        return;
-      }
-
-      void measurementUpdate(const MatrixX<_S> &H_o,
-                             const VectorX<_S> &r_o,
-                             const MatrixX<_S> &R_o) {
+      // The measurement noise is R_o = noise_var * I, as left by the null
+      // space projection in calcMeasJacobian.
+      // H_o and r_o are overwritten. Returns false, counted in
+      // num_skipped_updates_, if the update had to be skipped.
+      bool measurementUpdate(Eigen::Ref<MatrixX<_S>> H_o,
+                             Eigen::Ref<VectorX<_S>> r_o,
+                             const _S &noise_var) {
         if (r_o.size() != 0) {
-          // Build MSCKF covariance matrix
-          MatrixX<_S> P = MatrixX<_S>::Zero(15 + cam_covar_.rows(), 15 + cam_covar_.cols());
-          P.template block<15, 15>(0, 0) = imu_covar_;
-          if (cam_covar_.rows() != 0) {
-            P.block(0, 15, 15, imu_cam_covar_.cols()) = imu_cam_covar_;
-            P.block(15, 0, imu_cam_covar_.cols(), 15) = imu_cam_covar_.transpose();
-            P.block(15, 15, cam_covar_.rows(), cam_covar_.cols()) = cam_covar_;
-          }
-
-          MatrixX<_S> T_H, Q_1, R_n;
-          VectorX<_S> r_n;
+          // MSCKF covariance matrix
+          auto P = covar();
 
           // Put residuals in update-worthy form
           // Calculates T_H matrix according to Mourikis 2007
-          HouseholderQR<MatrixX<_S>> qr(H_o);
-          MatrixX<_S> Q = qr.householderQ();
-          MatrixX<_S> R = qr.matrixQR().template triangularView<Upper>();
-
-          VectorX<_S> nonZeroRows = R.rowwise().any();
-          int numNonZeroRows = nonZeroRows.sum();
-
-          T_H = MatrixX<_S>::Zero(numNonZeroRows, R.cols());
-          Q_1 = MatrixX<_S>::Zero(Q.rows(), numNonZeroRows);
-
-          size_t counter = 0;
-          for (size_t r_ind = 0; r_ind < R.rows(); r_ind++) {
-            if (nonZeroRows(r_ind) == 1.0) {
-              T_H.row(counter) = R.row(r_ind);
-              Q_1.col(counter) = Q.col(r_ind);
-              counter++;
-              if (counter > numNonZeroRows) {
-                //ROS_ERROR("More non zero rows than expected in QR decomp");
-              }
+          // H_o = [Q_1 Q_2] [T_H; 0], and only T_H and Q_1^T r_o are needed. The
+          // IMU columns of H_o are zero, so only its camera columns are
+          // factored, in place, with each reflector applied to r_o as it is
+          // formed instead of forming Q. R_n = Q_1^T R_o Q_1 stays
+          // noise_var * I. With no more rows than columns there is nothing to
+          // compress.
+          const int num_cam_cols = H_o.cols() - 15;
+          Eigen::Index num_rows = H_o.rows();
+          if (num_rows > num_cam_cols) {
+            auto H_c = H_o.rightCols(num_cam_cols);
+            auto workspace = scratch_.vector<_S>(num_cam_cols);
+            _S tau, beta;
+            for (int k = 0; k < num_cam_cols; k++) {
+              const Eigen::Index n = num_rows - k;
+              H_c.col(k).tail(n).makeHouseholderInPlace(tau, beta);
+              const auto essential = H_c.col(k).tail(n - 1);
+              H_c.bottomRightCorner(n, num_cam_cols - k - 1)
+                .applyHouseholderOnTheLeft(essential, tau, workspace.data());
+              r_o.tail(n).applyHouseholderOnTheLeft(essential, tau, workspace.data());
+              H_c(k, k) = beta;
+              H_c.col(k).tail(n - 1).setZero();
             }
+            num_rows = num_cam_cols;
+          }
+          const auto T_H = H_o.topRows(num_rows);
+          const auto r_n = r_o.head(num_rows);
+
+          // Kalman gain, state correction and covariance correction
+          auto deltaX = scratch_.vector<_S>(P.rows());
+          bool used_ldlt;
+          const bool updated = choleskyKalmanUpdate(P, T_H, r_n, noise_var, deltaX, scratch_,
+                                                    &used_ldlt);
+          if (used_ldlt) heap_allocations_++;
+          if (!updated) {
+            num_skipped_updates_++;
+            return false;
           }
-
-          r_n = Q_1.transpose() * r_o;
-          R_n = Q_1.transpose() * R_o * Q_1;
-
-          // Calculate Kalman Gain
-          MatrixX<_S> temp = T_H * P * T_H.transpose() + R_n;
-          MatrixX<_S> K = (P * T_H.transpose()) * temp.inverse();
-
-          // State Correction
-          VectorX<_S> deltaX = K * r_n;
 
           // Update IMU state (from updateState matlab function defined in MSCKF.m)
           Quaternion<_S> q_IG_up = buildUpdateQuat(deltaX.template head<3>()) * imu_state_.q_IG;
@@ -1383,47 +1780,24 @@ namespace msckf_mono {
           imu_state_.p_I_G += deltaX.template segment<3>(12);
 
           // Update Camera<_S> states
+          _S max_distance = 0, max_angle = 0;
           for (size_t c_i = 0; c_i < cam_states_.size(); c_i++) {
             Quaternion<_S> q_CG_up = buildUpdateQuat(deltaX.template segment<3>(15 + 6 * c_i)) *
               cam_states_[c_i].q_CG;
             cam_states_[c_i].q_CG = q_CG_up.normalized();
+            refreshCamRotation(cam_states_[c_i]);
             cam_states_[c_i].p_C_G += deltaX.template segment<3>(18 + 6 * c_i);
+            max_angle = std::max(max_angle, deltaX.template segment<3>(15 + 6 * c_i).norm());
+            max_distance = std::max(max_distance, deltaX.template segment<3>(18 + 6 * c_i).norm());
           }
-
-          // Covariance correction
-          MatrixX<_S> tempMat = MatrixX<_S>::Identity(15 + 6 * cam_states_.size(),
-                                                      15 + 6 * cam_states_.size()) -
-            K * T_H;
-
-          MatrixX<_S> P_corrected, P_corrected_transpose;
-          P_corrected = tempMat * P * tempMat.transpose() + K * R_n * K.transpose();
-          // Enforce symmetry
-          P_corrected_transpose = P_corrected.transpose();
-          P_corrected += P_corrected_transpose;
-          P_corrected /= 2;
-
-          if(P_corrected.rows()-15!=cam_covar_.rows()){
-            std::cout << "[P:" << P_corrected.rows() << "," << P_corrected.cols() << "]";
-            std::cout << "[cam_covar_:" << cam_covar_.rows() << "," << cam_covar_.cols() << "]";
-            std::cout << std::endl;
-          }
-
-          // TODO : Verify need for eig check on P_corrected here (doesn't seem too
-          // important for now)
-          imu_covar_ = P_corrected.template block<15, 15>(0, 0);
-
-          // TODO: Check here
-          cam_covar_ = P_corrected.block(15, 15, P_corrected.rows() - 15,
-                                         P_corrected.cols() - 15);
-          imu_cam_covar_ = P_corrected.block(0, 15, 15, P_corrected.cols() - 15);
-
-          return;
-        } else
-          return;
+          cam_travel_distance_ += max_distance;
+          cam_travel_angle_ += max_angle;
+        }
+        return true;
       }
 
-      imuState<_S> propogateImuStateRK(const imuState<_S> &imu_state_k,
-                                       const imuReading<_S> &measurement_k) {
+      static imuState<_S> propogateImuStateRK(const imuState<_S> &imu_state_k,
+                                              const imuReading<_S> &measurement_k) {
         imuState<_S> imuStateProp = imu_state_k;
         const _S dT(measurement_k.dT);
 
@@ -1466,22 +1840,190 @@ namespace msckf_mono {
         return imuStateProp;
       }
 
-      void removeTrackedFeature(const size_t featureID,
-                                std::vector<camState<_S>> &featCamStates,
-                                std::vector<size_t> &camStateIndices){
-        featCamStates.clear();
-        camStateIndices.clear();
-
-        for (size_t c_i = 0; c_i < cam_states_.size(); c_i++) {
-          auto feature_iter =
-            std::find(cam_states_[c_i].tracked_feature_ids.begin(),
-                      cam_states_[c_i].tracked_feature_ids.end(), featureID);
-          if (feature_iter != cam_states_[c_i].tracked_feature_ids.end()) {
-            cam_states_[c_i].tracked_feature_ids.erase(feature_iter);
-            camStateIndices.push_back(c_i);
-            featCamStates.push_back(cam_states_[c_i]);
+      // Unregisters track from the camera states that observed it and, if
+      // enough of them remain, queues its observations for marginalize().
+      void residualizeTrack(const featureTrack<_S> &track) {
+        featureTrackToResidualize<_S> track_to_residualize;
+        track_to_residualize.obs_begin = residual_obs_.size();
+
+        for (size_t j = 0; j < track.cam_state_indices.size(); j++) {
+          size_t position = camStatePosition(track.cam_state_indices[j]);
+          if (position == cam_states_.size()) continue;
+
+          // Order within tracked_feature_ids does not matter, so swap-remove
+          std::vector<size_t> &ids = cam_states_[position].tracked_feature_ids;
+          auto feature_iter = std::find(ids.begin(), ids.end(), track.feature_id);
+          if (feature_iter != ids.end()) {
+            *feature_iter = ids.back();
+            ids.pop_back();
+            appendObservation(residual_obs_, track.observations[j], position);
           }
         }
+
+        track_to_residualize.num_obs = residual_obs_.size() - track_to_residualize.obs_begin;
+        if (track_to_residualize.num_obs < msckf_params_.min_track_length) {
+          residual_obs_.resize(track_to_residualize.obs_begin);
+          return;
+        }
+
+        track_to_residualize.feature_id = track.feature_id;
+        track_to_residualize.initialized = track.initialized;
+        if (track.initialized) track_to_residualize.p_f_G = track.p_f_G;
+        track_to_residualize.triangulation = track.triangulation;
+
+        append(feature_tracks_to_residualize_, track_to_residualize);
+      }
+
+      void resetScratch() {
+        scratch_.reset();
+        for (auto &scratch : worker_scratch_) scratch.reset();
+      }
+
+      // Brings the cached rotation of cam_state in line with its q_CG. Must
+      // follow every change of q_CG.
+      void refreshCamRotation(camState<_S> &cam_state) const {
+        cam_state.R_CG = cam_state.q_CG.toRotationMatrix();
+        cam_state.R_CG_g = cam_state.R_CG * imu_state_.g;
+      }
+
+      // Arena of the calling thread inside the parallel loops of marginalize
+      ScratchArena &workerScratch() {
+#ifdef _OPENMP
+        return worker_scratch_[omp_get_thread_num()];
+#else
+        return worker_scratch_[0];
+#endif
+      }
+
+      // Position of state_id in cam_states_, or cam_states_.size() if it is
+      // not (or no longer) a camera state of the filter.
+      size_t camStatePosition(size_t state_id) const {
+        const size_t position = cam_state_positions_.find(state_id);
+        return position == IdIndexMap::npos ? cam_states_.size() : position;
+      }
+
+      // Re-indexes after states were removed from cam_states_. The map keeps
+      // its storage, so this does not allocate.
+      void rebuildCamStatePositions() {
+        cam_state_positions_.clear();
+        for (size_t i = 0; i < cam_states_.size(); i++) {
+          cam_state_positions_.set(cam_states_[i].state_id, i);
+        }
+      }
+
+      // Removes the camera states with to_keep[i] false from the window and
+      // the covariance. Kept states are swapped down in order. The removed
+      // states' tracked_feature_ids buffers go back to augmentState, and with
+      // keep_pruned_states the states are recorded in pruned_states_ without
+      // them.
+      void removeCamStates(const std::vector<bool> &to_keep) {
+        size_t num_kept = 0;
+        for (size_t i = 0; i < cam_states_.size(); i++) {
+          camState<_S> &cam_state = cam_states_[i];
+          if (to_keep[i]) {
+            if (num_kept != i) std::swap(cam_states_[num_kept], cam_state);
+            num_kept++;
+            continue;
+          }
+          cam_state.tracked_feature_ids.clear();
+          append(spare_feature_id_lists_, std::move(cam_state.tracked_feature_ids));
+          if (msckf_params_.keep_pruned_states) {
+            append(pruned_states_, std::move(cam_state));
+          }
+        }
+        cam_states_.resize(num_kept);
+        rebuildCamStatePositions();
+
+        removeCamStatesFromCovar(to_keep);
+      }
+
+      // cam_state_keep_, flagging every camera state in the window as kept
+      std::vector<bool>& resetCamStateKeepFlags() {
+        reserveCapacity(cam_state_keep_, cam_states_.size());
+        cam_state_keep_.assign(cam_states_.size(), true);
+        return cam_state_keep_;
+      }
+
+      // push_back, counting the reallocation when v is full. The filter's
+      // containers are cleared without releasing their storage, so these
+      // stop once each has reached its largest size.
+      template <typename _Vector, typename _Value>
+        void append(_Vector &v, _Value &&value) {
+          if (v.size() == v.capacity()) heap_allocations_++;
+          v.push_back(std::forward<_Value>(value));
+        }
+
+      void appendObservation(observationArena<_S> &obs, const Vector2<_S> &observation,
+                             size_t cam_state_slot) {
+        if (obs.full()) heap_allocations_++;
+        obs.push_back(observation, cam_state_slot);
+      }
+
+      // reserve, counting the reallocation if v has less room than n
+      template <typename _Vector>
+        void reserveCapacity(_Vector &v, size_t n) {
+          if (n <= v.capacity()) return;
+          heap_allocations_++;
+          v.reserve(n);
+        }
+
+      // Drops the observations of track made from the camera states for which
+      // is_removed(state_id) holds, keeping the rest in order.
+      template <typename _Pred>
+        void removeObservations(featureTrack<_S> &track, const _Pred &is_removed) {
+          size_t num_kept = 0;
+          for (size_t j = 0; j < track.cam_state_indices.size(); j++) {
+            if (!is_removed(track.cam_state_indices[j])) {
+              track.cam_state_indices[num_kept] = track.cam_state_indices[j];
+              track.observations[num_kept] = track.observations[j];
+              num_kept++;
+            }
+          }
+          track.cam_state_indices.resize(num_kept);
+          track.observations.resize(num_kept);
+        }
+
+      // Takes a free track slot (or a new one) for feature_id and makes it active.
+      featureTrack<_S>& addTrack(size_t feature_id) {
+        size_t slot;
+        if (free_track_slots_.empty()) {
+          slot = track_slots_.size();
+          append(track_slots_, featureTrack<_S>());
+          append(track_positions_, 0);
+          // A track has at most one observation per camera state
+          const size_t max_length = std::min<size_t>(msckf_params_.max_track_length,
+                                                     msckf_params_.max_cam_states + 2);
+          reserveCapacity(track_slots_[slot].observations, max_length);
+          reserveCapacity(track_slots_[slot].cam_state_indices, max_length);
+        } else {
+          slot = free_track_slots_.back();
+          free_track_slots_.pop_back();
+        }
+
+        featureTrack<_S> &track = track_slots_[slot];
+        track.feature_id = feature_id;
+        track.observations.clear();
+        track.cam_state_indices.clear();
+        track.initialized = false;
+        track.triangulation = triangulationCache<_S>();
+
+        track_slot_by_id_.set(feature_id, slot);
+        track_positions_[slot] = active_track_slots_.size();
+        append(active_track_slots_, slot);
+        return track;
+      }
+
+      // Deactivates the track in slot, moving the last active track into its
+      // place in active_track_slots_. The slot's buffers are kept for reuse.
+      void removeTrack(size_t slot) {
+        size_t position = track_positions_[slot];
+        size_t last_slot = active_track_slots_.back();
+        active_track_slots_[position] = last_slot;
+        track_positions_[last_slot] = position;
+        active_track_slots_.pop_back();
+
+        track_slot_by_id_.erase(track_slots_[slot].feature_id);
+        append(free_track_slots_, slot);
       }
 
       Vector3<_S> Triangulate(const Vector2<_S> &obs1,
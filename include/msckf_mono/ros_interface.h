@@ -14,7 +14,17 @@
 #include <msckf_mono/types.h>
 #include <msckf_mono/msckf.h>
 #include <msckf_mono/corner_detector.h>
+#include <msckf_mono/bounded_queue.h>
+#include <msckf_mono/spsc_ring.h>
+#include <msckf_mono/StageTiming.h>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
 
 namespace msckf_mono
 {
@@ -23,6 +33,7 @@ namespace msckf_mono
       EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
       RosInterface(ros::NodeHandle nh);
+      ~RosInterface();
 
       void imuCallback(const sensor_msgs::ImuConstPtr& imu);
 
@@ -32,6 +43,8 @@ namespace msckf_mono
 
       void publish_extra(const ros::Time& publish_time);
 
+      void publish_imu_rate(const ros::Time& publish_time);
+
     private:
       ros::NodeHandle nh_;
       image_transport::ImageTransport it_;
@@ -48,8 +61,91 @@ namespace msckf_mono
 
       bool debug_;
 
-      std::vector<std::tuple<double, imuReading<float>>> imu_queue_;
-      double prev_imu_time_;
+      // imuCallback and imageCallback may run on different spinner threads.
+      // Each consumer of IMU readings gets its own single-producer buffer fed
+      // by imuCallback.
+      typedef std::tuple<double, imuReading<float>> StampedImuReading;
+      int imu_buffer_size_;
+      std::atomic<double> prev_imu_time_;
+
+      // Readings for IMU calibration and the tracker's gyro prediction,
+      // consumed by the image callback. Readings are moved into
+      // calibration_readings_ until the IMU is calibrated.
+      std::unique_ptr<SpscRing<StampedImuReading>> imu_ring_;
+      std::vector<imuReading<float>> calibration_readings_;
+      size_t gyro_readings_dropped_;
+
+      // Readings waiting to be propagated by the filter thread. A frame lost
+      // to backpressure leaves its readings to the next. When the filter
+      // falls this far behind, imuCallback drops the oldest reading rather
+      // than wait, and the next reading propagated covers the gap.
+      std::unique_ptr<BoundedQueue<StampedImuReading>> filter_imu_queue_;
+      size_t imu_readings_dropped_;
+      // Only touched by the filter thread: a popped reading newer than the
+      // frame, kept for the next one, and the time of the last one propagated
+      std::vector<imuReading<float>> imu_since_prev_img_;
+      StampedImuReading next_filter_imu_;
+      bool has_next_filter_imu_;
+      double last_filter_imu_time_;
+
+      // Tracking runs in the image callback and hands each frame's features
+      // to the filter thread through frame_queue_. When the filter falls
+      // behind, the callback either drops the oldest queued frame or waits
+      // for room. The filter thread sleeps on frame_ready_ while the queue is
+      // empty, and a blocked callback on frame_space_ while it is full.
+      struct FeatureBatch {
+        ros::Time stamp;
+        double time;
+        std::vector<Vector2<float>,
+          Eigen::aligned_allocator<Vector2<float>>> cur_features;
+        corner_detector::IdVector cur_ids;
+        std::vector<Vector2<float>,
+          Eigen::aligned_allocator<Vector2<float>>> new_features;
+        corner_detector::IdVector new_ids;
+        // Wall clock times for the stage_timing latencies
+        ros::WallTime received;
+        ros::WallTime enqueued;
+      };
+
+      enum BackpressurePolicy { DropOldest, Block };
+      BackpressurePolicy backpressure_policy_;
+      int frame_queue_size_;
+      std::unique_ptr<BoundedQueue<FeatureBatch>> frame_queue_;
+      size_t frames_dropped_;
+      std::mutex frame_mutex_;
+      std::condition_variable frame_ready_;
+      std::condition_variable frame_space_;
+
+      std::atomic<bool> running_;
+      std::thread filter_thread_;
+      void enqueue_frame(FeatureBatch& batch);
+      void filter_loop();
+      void process_frame(FeatureBatch& batch);
+
+      ros::Publisher timing_pub_;
+
+      // IMU-rate odometry (imu_rate_odom). imuCallback propagates a nominal
+      // copy of the IMU state with every reading and publishes it on
+      // imu_odom. After each frame the filter thread posts its corrected
+      // state, and imuCallback restarts from it and re-propagates the
+      // readings newer than that frame.
+      bool imu_rate_odom_;
+      ros::Publisher imu_odom_pub_;
+      std::mutex corrected_mutex_;
+      imuState<float> corrected_state_;
+      double corrected_time_;
+      std::atomic<unsigned> corrected_seq_;
+      void post_corrected_state(double time);
+
+      // Only touched by imuCallback
+      unsigned applied_seq_;
+      bool imu_rate_started_;
+      imuState<float> imu_rate_state_;
+      std::deque<StampedImuReading> imu_rate_readings_;
+      void propagate_imu_rate(const StampedImuReading& stamped);
+
+      void fill_odometry(const imuState<float>& imu_state, const ros::Time& stamp,
+                         nav_msgs::Odometry& odom) const;
 
       void setup_track_handler();
       std::shared_ptr<corner_detector::TrackHandler> track_handler_;
@@ -67,13 +163,16 @@ namespace msckf_mono
 
       int n_grid_cols_;
       int n_grid_rows_;
+      corner_detector::DetectionMethod detection_method_;
+      int detection_threads_;
+      corner_detector::ScoringMethod scoring_method_;
       float ransac_threshold_;
 
       enum CalibrationMethod { TimedStandStill };
       CalibrationMethod imu_calibration_method_;
 
       double stand_still_time_;
-      double done_stand_still_time_;
+      std::atomic<double> done_stand_still_time_;
 
       std::atomic<bool> imu_calibrated_;
       bool can_initialize_imu();
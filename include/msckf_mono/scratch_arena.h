@@ -0,0 +1,153 @@
+#ifndef MSCKF_MONO_SCRATCH_ARENA_H_
+#define MSCKF_MONO_SCRATCH_ARENA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include <msckf_mono/types.h>
+
+namespace msckf_mono {
+  // Bump allocator for the filter's per-frame temporaries. Memory handed out
+  // stays valid until the next reset() (or a rewind() past it) and is never
+  // freed individually, so it must only hold trivially destructible data such
+  // as Eigen matrices of scalars viewed through Map.
+  //
+  // When a request does not fit, a new block is taken from the heap; reset()
+  // then merges all blocks into one of the combined size. After a warm-up
+  // frame of maximal size the arena takes no new blocks, which
+  // blockAllocations() makes observable. It only counts the arena's own
+  // blocks, not other heap allocations made by its users.
+  //
+  // Copies start out empty, so a copied owner gets its own scratch space.
+  // Not thread safe: give each worker thread its own arena.
+  class ScratchArena {
+    public:
+      static constexpr size_t kAlignment = 64;
+
+      template <typename _Scalar>
+        using MatrixMap = Eigen::Map<MatrixX<_Scalar>, Eigen::AlignedMax>;
+      template <typename _Scalar>
+        using VectorMap = Eigen::Map<VectorX<_Scalar>, Eigen::AlignedMax>;
+
+      // Position in the arena to rewind() to, for temporaries scoped tighter
+      // than a frame.
+      struct Mark {
+        size_t block;
+        size_t offset;
+      };
+
+      explicit ScratchArena(size_t initial_bytes = 0)
+        : current_(0), offset_(0), capacity_(0), block_allocations_(0) {
+        if (initial_bytes) addBlock(initial_bytes);
+      }
+
+      ScratchArena(const ScratchArena&)
+        : current_(0), offset_(0), capacity_(0), block_allocations_(0) {}
+
+      ScratchArena& operator=(const ScratchArena& other) {
+        if (this != &other) {
+          blocks_.clear();
+          current_ = 0;
+          offset_ = 0;
+          capacity_ = 0;
+          block_allocations_ = 0;
+        }
+        return *this;
+      }
+
+      ScratchArena(ScratchArena&&) = default;
+      ScratchArena& operator=(ScratchArena&&) = default;
+
+      // Starts a new frame. Invalidates everything handed out so far.
+      void reset() {
+        if (blocks_.size() > 1) {
+          const size_t total = capacity_;
+          blocks_.clear();
+          capacity_ = 0;
+          addBlock(total);
+        }
+        current_ = 0;
+        offset_ = 0;
+      }
+
+      Mark mark() const { return {current_, offset_}; }
+
+      void rewind(const Mark& m) {
+        current_ = m.block;
+        offset_ = m.offset;
+      }
+
+      void* allocate(size_t bytes) {
+        bytes = (bytes + kAlignment - 1) / kAlignment * kAlignment;
+        for (; current_ < blocks_.size(); ++current_, offset_ = 0) {
+          if (offset_ + bytes <= blocks_[current_].size) {
+            void* p = blocks_[current_].data + offset_;
+            offset_ += bytes;
+            return p;
+          }
+        }
+        // Grow geometrically so a warm-up frame needs few blocks
+        const size_t grow = capacity_ > kMinBlockBytes ? capacity_ : kMinBlockBytes;
+        addBlock(bytes > grow ? bytes : grow);
+        current_ = blocks_.size() - 1;
+        offset_ = bytes;
+        return blocks_.back().data;
+      }
+
+      // Default-initialized array of n elements.
+      template <typename T>
+        T* allocate(size_t n) {
+          T* p = static_cast<T*>(allocate(n * sizeof(T)));
+          for (size_t i = 0; i < n; i++) new (p + i) T;
+          return p;
+        }
+
+      template <typename _Scalar>
+        MatrixMap<_Scalar> matrix(Eigen::Index rows, Eigen::Index cols) {
+          return MatrixMap<_Scalar>(
+            static_cast<_Scalar*>(allocate(rows * cols * sizeof(_Scalar))), rows, cols);
+        }
+
+      template <typename _Scalar>
+        VectorMap<_Scalar> vector(Eigen::Index size) {
+          return VectorMap<_Scalar>(
+            static_cast<_Scalar*>(allocate(size * sizeof(_Scalar))), size);
+        }
+
+      // Number of blocks taken from the heap since construction.
+      size_t blockAllocations() const { return block_allocations_; }
+
+      size_t capacity() const { return capacity_; }
+
+    private:
+      static constexpr size_t kMinBlockBytes = 64 * 1024;
+
+      struct Block {
+        std::unique_ptr<char[]> storage;
+        char* data;
+        size_t size;
+      };
+
+      void addBlock(size_t bytes) {
+        Block block;
+        block.storage.reset(new char[bytes + kAlignment]);
+        const std::uintptr_t address = reinterpret_cast<std::uintptr_t>(block.storage.get());
+        block.data = block.storage.get() + (kAlignment - address % kAlignment) % kAlignment;
+        block.size = bytes;
+        blocks_.push_back(std::move(block));
+        capacity_ += bytes;
+        block_allocations_++;
+      }
+
+      std::vector<Block> blocks_;
+      size_t current_;
+      size_t offset_;
+      size_t capacity_;
+      size_t block_allocations_;
+  };
+}
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef MSCKF_MONO_SPSC_RING_H_
+#define MSCKF_MONO_SPSC_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace msckf_mono {
+  // Fixed-capacity lock-free ring buffer for exactly one producer thread and
+  // one consumer thread. Elements are written in place and consumed in runs
+  // with popWhile, so taking a range off the front is a single index update
+  // rather than an erase.
+  //
+  // T must be default constructible and copy assignable.
+  template <typename T>
+    class SpscRing {
+      public:
+        // Capacity is rounded up to a power of two.
+        explicit SpscRing(size_t capacity)
+          : head_(0), tail_(0) {
+          size_t size = 2;
+          while (size < capacity) size *= 2;
+          buffer_.reset(new T[size]);
+          mask_ = size - 1;
+        }
+
+        SpscRing(const SpscRing&) = delete;
+        SpscRing& operator=(const SpscRing&) = delete;
+
+        // Producer only. Returns false if the ring is full.
+        bool tryPush(const T& value) {
+          const size_t tail = tail_.load(std::memory_order_relaxed);
+          if (tail - head_.load(std::memory_order_acquire) > mask_) return false;
+          buffer_[tail & mask_] = value;
+          tail_.store(tail + 1, std::memory_order_release);
+          return true;
+        }
+
+        // Consumer only. Pops the elements at the front for which pred holds,
+        // oldest first, handing each to f. Stops at the first element that
+        // fails pred, so for elements ordered by time a pred of the form
+        // "stamp <= t" extracts exactly the range up to t. Returns the number
+        // popped.
+        template <typename _Pred, typename _Func>
+          size_t popWhile(_Pred pred, _Func f) {
+            const size_t head = head_.load(std::memory_order_relaxed);
+            const size_t tail = tail_.load(std::memory_order_acquire);
+            size_t pos = head;
+            for (; pos != tail && pred(buffer_[pos & mask_]); pos++) {
+              f(buffer_[pos & mask_]);
+            }
+            head_.store(pos, std::memory_order_release);
+            return pos - head;
+          }
+
+        // Consumer only. Pops everything currently in the ring.
+        template <typename _Func>
+          size_t popAll(_Func f) {
+            return popWhile([](const T&) { return true; }, f);
+          }
+
+        size_t capacity() const { return mask_ + 1; }
+
+      private:
+        std::unique_ptr<T[]> buffer_;
+        size_t mask_;
+        // Consumer and producer indices on separate cache lines. They only
+        // grow; positions in buffer_ are taken modulo the capacity.
+        char pad0_[64];
+        std::atomic<size_t> head_;
+        char pad1_[64 - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t> tail_;
+        char pad2_[64 - sizeof(std::atomic<size_t>)];
+    };
+}
+
+#endif
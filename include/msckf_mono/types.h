@@ -60,12 +60,21 @@ namespace msckf_mono {
 
         Point<_Scalar> p_C_G;
       Quaternion<_Scalar> q_CG;
+      // q_CG as a matrix and R_CG * g, refreshed whenever q_CG changes
+      Matrix3<_Scalar> R_CG;
+      Vector3<_Scalar> R_CG_g;
       _Scalar time;
       int state_id;
       int last_correlated_id;
       std::vector<size_t> tracked_feature_ids;
     };
 
+  // camState holds fixed-size vectorizable Eigen members, which std::vector's
+  // default allocator does not align
+  template <typename _Scalar>
+    using camStateVector = std::vector<camState<_Scalar>,
+          Eigen::aligned_allocator<camState<_Scalar>>>;
+
   template <typename _Scalar>
     struct imuState {
       EIGEN_MAKE_ALIGNED_OPERATOR_NEW;
@@ -91,26 +100,96 @@ namespace msckf_mono {
       Eigen::Matrix<_Scalar, 15, 15> initial_imu_covar;
     };
 
+  // How the discrete IMU error-state transition matrix is built each sample
+  enum TransitionMethod { MatrixExponential, ClosedForm };
+
   template <typename _Scalar>
     struct MSCKFParams {
       _Scalar max_gn_cost_norm, min_rcond, translation_threshold;
       _Scalar redundancy_angle_thresh, redundancy_distance_thresh;
       int min_track_length, max_track_length, max_cam_states;
+      TransitionMethod transition_method = MatrixExponential;
+      // Worker threads for per-track marginalization, only used with OpenMP
+      int num_threads = 1;
+      // A cached feature triangulation is reused until an observation is
+      // added to its track or some camera state may have moved further than
+      // this (meters, radians) since it was solved
+      _Scalar triangulation_distance_thresh = 0.005;
+      _Scalar triangulation_angle_thresh = 0.005;
+      // Record the camera states removed from the window for
+      // MSCKF::getPrunedStates. The record grows for the life of the filter.
+      bool keep_pruned_states = true;
+    };
+
+  // Last valid triangulation of a feature track, see MSCKF::triangulate
+  template <typename _Scalar>
+    struct triangulationCache {
+      bool solved = false;
+      // No observation was added to the track since it was solved. Removing
+      // observations keeps the solution current.
+      bool current = false;
+      Vector3<_Scalar> p_f_G = Vector3<_Scalar>::Zero();
+      // MSCKF camera travel bounds when solved
+      _Scalar travel_distance = 0;
+      _Scalar travel_angle = 0;
     };
 
+  // One track for MSCKF::triangulateTracks: its observations in an
+  // observationArena and the cache to solve through. num_obs == 0 skips it.
   template <typename _Scalar>
-    struct featureTrackToResidualize {
-      size_t feature_id;
+    struct triangulationJob {
+      size_t obs_begin;
+      size_t num_obs;
+      triangulationCache<_Scalar> *cache;
+    };
+
+  // Observations of the tracks residualized in one frame, stored as
+  // parallel arrays. Each track owns a contiguous run of entries; cameras are
+  // referenced by their position in the filter's camera states, not copied.
+  template <typename _Scalar>
+    struct observationArena {
       std::vector<Vector2<_Scalar>,
         Eigen::aligned_allocator<Vector2<_Scalar>>> observations;
+      std::vector<size_t> cam_state_slots;
+
+      size_t size() const { return observations.size(); }
+
+      void push_back(const Vector2<_Scalar>& observation, size_t cam_state_slot) {
+        observations.push_back(observation);
+        cam_state_slots.push_back(cam_state_slot);
+      }
+
+      // Whether the next push_back reallocates
+      bool full() const {
+        return observations.size() == observations.capacity() ||
+          cam_state_slots.size() == cam_state_slots.capacity();
+      }
+
+      void resize(size_t n) {
+        observations.resize(n);
+        cam_state_slots.resize(n);
+      }
+
+      // Keeps the capacity, so steady-state frames do not allocate
+      void clear() {
+        observations.clear();
+        cam_state_slots.clear();
+      }
+    };
+
+  template <typename _Scalar>
+    struct featureTrackToResidualize {
+      size_t feature_id;
 
-      std::vector<camState<_Scalar>> cam_states;
-      std::vector<size_t> cam_state_indices;
+      // Run [obs_begin, obs_begin + num_obs) of the filter's observationArena
+      size_t obs_begin;
+      size_t num_obs;
 
       bool initialized;
       Vector3<_Scalar> p_f_G;
+      triangulationCache<_Scalar> triangulation;
 
-      featureTrackToResidualize() : initialized(false) {}
+      featureTrackToResidualize() : obs_begin(0), num_obs(0), initialized(false) {}
     };
 
   template <typename _Scalar>
@@ -123,6 +202,7 @@ namespace msckf_mono {
 
       bool initialized = false;
       Vector3<_Scalar> p_f_G;
+      triangulationCache<_Scalar> triangulation;
     };
 }
 
@@ -5,5 +5,10 @@ int main(int argc, char** argv) {
   ros::init(argc, argv, "msckf_mono_node");
   ros::NodeHandle nh;
   msckf_mono::RosInterface ri(nh);
-  ros::spin();
+  // IMU and image callbacks on separate threads. Callbacks of one
+  // subscription are still serialized, so each IMU ring keeps a single
+  // producer and consumer.
+  ros::AsyncSpinner spinner(2);
+  spinner.start();
+  ros::waitForShutdown();
 }
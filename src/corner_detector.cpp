@@ -1,16 +1,33 @@
 #include <msckf_mono/corner_detector.h>
 #include <opencv2/calib3d.hpp>
 #include <set>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace corner_detector
 {
 
+// The top-left size of buffer as a matrix of type, growing buffer first if it
+// is too small. OpenCV functions writing to the view keep its data.
+static cv::Mat buffer_view(cv::Mat& buffer, cv::Size size, int type)
+{
+  if(buffer.type() != type || buffer.rows < size.height || buffer.cols < size.width)
+    buffer.create(std::max(buffer.rows, size.height), std::max(buffer.cols, size.width), type);
+  return buffer(cv::Rect(cv::Point(0, 0), size));
+}
+
 CornerDetector::CornerDetector(int n_rows, int n_cols, double detection_threshold) :
   grid_n_rows_(n_rows), grid_n_cols_(n_cols),
-  detection_threshold_(detection_threshold)
+  detection_threshold_(detection_threshold),
+  detection_method_(FullImageDetection), num_threads_(1),
+  scoring_method_(BoxScoring), gradient_integrals_(1)
 {
   occupancy_grid_.clear();
   occupancy_grid_.resize(grid_n_rows_*grid_n_cols_, false);
+  // Central differences as in shiTomasiScore
+  dx_kernel_ = (cv::Mat_<float>(1, 3) << -1, 0, 1);
+  dy_kernel_ = dx_kernel_.t();
 }
 
 void CornerDetector::set_grid_size(int n_rows, int n_cols) {
@@ -19,6 +36,16 @@ void CornerDetector::set_grid_size(int n_rows, int n_cols) {
   occupancy_grid_.resize(grid_n_rows_*grid_n_cols_, false);
 }
 
+void CornerDetector::set_detection_method(DetectionMethod method, int num_threads) {
+  detection_method_ = method;
+  num_threads_ = std::max(1, num_threads);
+  gradient_integrals_.resize(num_threads_);
+}
+
+void CornerDetector::set_scoring_method(ScoringMethod method) {
+  scoring_method_ = method;
+}
+
 int CornerDetector::sub2ind(const cv::Point2f& sub) {
   return static_cast<int>(sub.y / grid_height_)*grid_n_cols_
     + static_cast<int>(sub.x / grid_width_);
@@ -78,6 +105,81 @@ CornerDetector::shiTomasiScore(const cv::Mat& img, int u, int v)
   return 0.5 * (dXX + dYY - sqrt( (dXX + dYY) * (dXX + dYY) - 4 * (dXX * dYY - dXY * dXY) ));
 }
 
+void CornerDetector::compute_gradient_integral(const cv::Mat& image, const cv::Rect& region,
+                                               GradientIntegral& integral)
+{
+  integral.region = region;
+  integral.image_size = image.size();
+
+  // Differentiate region plus a one pixel margin, so the differences at its
+  // edges see the real neighbours. Only the image border is replicated.
+  const cv::Rect padded = cv::Rect(region.x - 1, region.y - 1, region.width + 2, region.height + 2)
+    & cv::Rect(cv::Point(0, 0), image.size());
+  cv::Mat image_f = buffer_view(integral.image_f, padded.size(), CV_32F);
+  image(padded).convertTo(image_f, CV_32F);
+  // filter2D, multiply and integral are vectorized inside OpenCV.
+  // BORDER_ISOLATED keeps filter2D from reading the rest of the buffers.
+  cv::Mat dx = buffer_view(integral.dx, padded.size(), CV_32F);
+  cv::Mat dy = buffer_view(integral.dy, padded.size(), CV_32F);
+  const int border = cv::BORDER_REPLICATE | cv::BORDER_ISOLATED;
+  cv::filter2D(image_f, dx, CV_32F, dx_kernel_, cv::Point(-1, -1), 0, border);
+  cv::filter2D(image_f, dy, CV_32F, dy_kernel_, cv::Point(-1, -1), 0, border);
+
+  const cv::Rect inner(region.tl() - padded.tl(), region.size());
+  cv::Mat products[3];
+  for(int c = 0; c < 3; c++)
+    products[c] = buffer_view(integral.products[c], region.size(), CV_32F);
+  cv::multiply(dx(inner), dx(inner), products[0]);
+  cv::multiply(dy(inner), dy(inner), products[1]);
+  cv::multiply(dx(inner), dy(inner), products[2]);
+  cv::Mat merged = buffer_view(integral.merged, region.size(), CV_32FC3);
+  cv::merge(products, 3, merged);
+
+  // Double sums so the four-corner differences stay exact
+  integral.sum = buffer_view(integral.sum_buffer,
+                             cv::Size(region.width + 1, region.height + 1), CV_64FC3);
+  cv::integral(merged, integral.sum, CV_64F);
+}
+
+float
+CornerDetector::integralShiTomasiScore(const GradientIntegral& integral, int u, int v) const
+{
+  const int halfbox_size = 15;
+  const int box_size = 2*halfbox_size;
+  const int box_area = box_size*box_size;
+  const int x_min = u-halfbox_size;
+  const int x_max = u+halfbox_size;
+  const int y_min = v-halfbox_size;
+  const int y_max = v+halfbox_size;
+
+  const cv::Size& size = integral.image_size;
+  if(x_min < 1 || x_max >= size.width-1 || y_min < 1 || y_max >= size.height-1)
+    return 0.0; // patch is too close to the boundary
+
+  // Sum over [x_min, x_max) x [y_min, y_max), in table coordinates
+  const cv::Rect& region = integral.region;
+  assert(x_min >= region.x && x_max <= region.br().x &&
+         y_min >= region.y && y_max <= region.br().y);
+  const cv::Vec3d* top = integral.sum.ptr<cv::Vec3d>(y_min - region.y);
+  const cv::Vec3d* bottom = integral.sum.ptr<cv::Vec3d>(y_max - region.y);
+  const int left = x_min - region.x;
+  const int right = x_max - region.x;
+  const cv::Vec3d sum = bottom[right] - bottom[left] - top[right] + top[left];
+
+  const float dXX = sum[0] / (2.0 * box_area);
+  const float dYY = sum[1] / (2.0 * box_area);
+  const float dXY = sum[2] / (2.0 * box_area);
+  return 0.5 * (dXX + dYY - sqrt( (dXX + dYY) * (dXX + dYY) - 4 * (dXX * dYY - dXY * dXY) ));
+}
+
+float CornerDetector::corner_score(const cv::Mat& image, const GradientIntegral& integral,
+                                   int u, int v)
+{
+  if(scoring_method_ == IntegralImageScoring)
+    return integralShiTomasiScore(integral, u, v);
+  return shiTomasiScore(image, u, v);
+}
+
 void CornerDetector::detect_features(const cv::Mat& image, std::vector<cv::Point2f>& features)
 {
   grid_height_ = (image.rows / grid_n_rows_)+1;
@@ -86,6 +188,28 @@ void CornerDetector::detect_features(const cv::Mat& image, std::vector<cv::Point
   features.clear();
   std::vector<double> score_table(grid_n_rows_ * grid_n_cols_);
   std::vector<cv::Point2f> feature_table(grid_n_rows_ * grid_n_cols_);
+
+  if(detection_method_ == GridCellDetection)
+    detect_grid_cells(image, score_table, feature_table);
+  else
+    detect_full_image(image, score_table, feature_table);
+
+  // Create feature for every corner that has high enough corner score
+  // ALEX: Replaced corner object from original code
+  for (int i = 0; i < score_table.size(); i++ )
+  {
+    if(score_table[i] > detection_threshold_)
+    {
+      cv::Point2f pos = feature_table[i];
+      features.push_back(cv::Point2f(pos.x, pos.y));
+    }
+  }
+  zero_occupancy_grid();
+}
+
+void CornerDetector::detect_full_image(const cv::Mat& image, std::vector<double>& score_table,
+                                       std::vector<cv::Point2f>& feature_table)
+{
   std::vector<fast::fast_xy> fast_corners;
 
 #ifdef __SSE2__
@@ -102,6 +226,10 @@ void CornerDetector::detect_features(const cv::Mat& image, std::vector<cv::Point
   fast::fast_corner_score_10((fast::fast_byte*) image.data, image.cols, fast_corners, 20, scores);
   fast::fast_nonmax_3x3(fast_corners, scores, nm_corners);
 
+  if(scoring_method_ == IntegralImageScoring)
+    compute_gradient_integral(image, cv::Rect(cv::Point(0, 0), image.size()),
+                              gradient_integrals_[0]);
+
   // ALEX: Updated loop
   for(auto it:nm_corners)
   {
@@ -112,25 +240,112 @@ void CornerDetector::detect_features(const cv::Mat& image, std::vector<cv::Point
     const int k = sub2ind(cv::Point2f(xy.x, xy.y));
     if(occupancy_grid_[k])
       continue;
-    const float score = shiTomasiScore(image, xy.x, xy.y);
+    const float score = corner_score(image, gradient_integrals_[0], xy.x, xy.y);
     if(score > score_table[k])
     {
       score_table[k] = static_cast<double>(score);
       feature_table[k] = cv::Point2f(xy.x, xy.y);
     }
   }
+}
 
-  // Create feature for every corner that has high enough corner score
-  // ALEX: Replaced corner object from original code
-  for (int i = 0; i < score_table.size(); i++ )
+void CornerDetector::detect_grid_cells(const cv::Mat& image, std::vector<double>& score_table,
+                                       std::vector<cv::Point2f>& feature_table)
+{
+  // FAST needs a circle of radius 3 around each pixel it tests, so it
+  // skips the outer 3 pixels of the region it is given
+  const int fast_border = 3;
+#ifdef __SSE2__
+  // The SSE2 detector tests x < 16 one pixel at a time before its 16 pixel
+  // blocks, whatever the width, so narrower regions get the plain detector
+  const int sse2_min_width = 16 + fast_border;
+#endif
+  // Half the Shi-Tomasi box
+  const int score_border = 15;
+
+  std::vector<int> empty_cells;
+  for (int k = 0; k < grid_n_rows_ * grid_n_cols_; k++)
   {
-    if(score_table[i] > detection_threshold_)
+    if (!occupancy_grid_[k])
+      empty_cells.push_back(k);
+  }
+
+  // Each cell only writes its own entry of score_table / feature_table
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic) num_threads(num_threads_)
+#endif
+  for (int i = 0; i < static_cast<int>(empty_cells.size()); i++)
+  {
+    const int k = empty_cells[i];
+    const int cell_x = (k % grid_n_cols_) * grid_width_;
+    const int cell_y = (k / grid_n_cols_) * grid_height_;
+    const int cell_x_end = std::min(cell_x + grid_width_, image.cols);
+    const int cell_y_end = std::min(cell_y + grid_height_, image.rows);
+    if (cell_x >= cell_x_end || cell_y >= cell_y_end)
+      continue;
+
+    // Pad the cell by one pixel more than FAST skips, so the cell and the
+    // ring of pixels around it get tested and the 3x3 non-max suppression
+    // sees the neighbours of corners on the cell edge
+    const int pad = fast_border + 1;
+    int x0 = std::max(cell_x - pad, 0);
+    const int y0 = std::max(cell_y - pad, 0);
+    const int x1 = std::min(cell_x_end + pad, image.cols);
+    const int y1 = std::min(cell_y_end + pad, image.rows);
+#ifdef __SSE2__
+    // The SSE2 detector loads 16 pixel blocks aligned to the row start
+    x0 &= ~15;
+#endif
+    fast::fast_byte* roi = (fast::fast_byte*) image.ptr(y0) + x0;
+    const int stride = static_cast<int>(image.step.p[0]);
+
+    std::vector<fast::fast_xy> fast_corners;
+#ifdef __SSE2__
+    if (x1 - x0 >= sse2_min_width)
+      fast::fast_corner_detect_10_sse2(roi, x1 - x0, y1 - y0, stride, 20, fast_corners);
+    else
+      fast::fast_corner_detect_10(roi, x1 - x0, y1 - y0, stride, 20, fast_corners);
+#else
+    fast::fast_corner_detect_10(roi, x1 - x0, y1 - y0, stride, 20, fast_corners);
+#endif
+
+    std::vector<int> scores, nm_corners;
+    fast::fast_corner_score_10(roi, stride, fast_corners, 20, scores);
+    fast::fast_nonmax_3x3(fast_corners, scores, nm_corners);
+
+#ifdef _OPENMP
+    GradientIntegral& integral = gradient_integrals_[omp_get_thread_num()];
+#else
+    GradientIntegral& integral = gradient_integrals_[0];
+#endif
+    bool have_integral = false;
+
+    for (auto it : nm_corners)
     {
-      cv::Point2f pos = feature_table[i];
-      features.push_back(cv::Point2f(pos.x, pos.y));
+      const int x = fast_corners[it].x + x0;
+      const int y = fast_corners[it].y + y0;
+      // Corners in the padding belong to the neighbouring cells
+      if (x < cell_x || x >= cell_x_end || y < cell_y || y >= cell_y_end)
+        continue;
+      // The table covers the boxes of all corners in the cell, and is only
+      // built for cells that have one
+      if (scoring_method_ == IntegralImageScoring && !have_integral)
+      {
+        const cv::Rect region =
+          cv::Rect(cell_x - score_border, cell_y - score_border,
+                   cell_x_end - cell_x + 2*score_border, cell_y_end - cell_y + 2*score_border)
+          & cv::Rect(cv::Point(0, 0), image.size());
+        compute_gradient_integral(image, region, integral);
+        have_integral = true;
+      }
+      const float score = corner_score(image, integral, x, y);
+      if (score > score_table[k])
+      {
+        score_table[k] = static_cast<double>(score);
+        feature_table[k] = cv::Point2f(x, y);
+      }
     }
   }
-  zero_occupancy_grid();
 }
 
 CornerTracker::CornerTracker(int window_size,
@@ -212,6 +427,14 @@ void TrackHandler::set_grid_size(int n_rows, int n_cols) {
   detector_.set_grid_size(n_rows, n_cols);
 }
 
+void TrackHandler::set_detection_method(DetectionMethod method, int num_threads) {
+  detector_.set_detection_method(method, num_threads);
+}
+
+void TrackHandler::set_scoring_method(ScoringMethod method) {
+  detector_.set_scoring_method(method);
+}
+
 void TrackHandler::add_gyro_reading(Eigen::Vector3f& gyro_reading) {
   gyro_accum_ += gyro_reading;
   n_gyro_readings_++;
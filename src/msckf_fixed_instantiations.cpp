@@ -0,0 +1,11 @@
+#include <msckf_mono/msckf.h>
+
+namespace msckf_mono
+{
+  // Fixed-capacity filters for deployments that know max_cam_states at build
+  // time. Instantiated here so the fixed-size code paths are compiled once.
+  template class MSCKF<float, 20>;
+  template class MSCKF<float, 30>;
+  template class MSCKF<double, 20>;
+  template class MSCKF<double, 30>;
+}
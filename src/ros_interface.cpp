@@ -6,27 +6,61 @@ namespace msckf_mono
     nh_(nh),
     it_(nh_),
     imu_calibrated_(false),
-    prev_imu_time_(0.0)
+    prev_imu_time_(0.0),
+    done_stand_still_time_(0.0),
+    gyro_readings_dropped_(0),
+    imu_readings_dropped_(0),
+    has_next_filter_imu_(false),
+    last_filter_imu_time_(0.0),
+    frames_dropped_(0),
+    running_(true),
+    corrected_seq_(0),
+    applied_seq_(0),
+    imu_rate_started_(false)
   {
     load_parameters();
     setup_track_handler();
 
+    frame_queue_.reset(new BoundedQueue<FeatureBatch>(frame_queue_size_));
+    imu_ring_.reset(new SpscRing<StampedImuReading>(imu_buffer_size_));
+    filter_imu_queue_.reset(new BoundedQueue<StampedImuReading>(imu_buffer_size_));
+
     odom_pub_ = nh.advertise<nav_msgs::Odometry>("odom", 100);
     path_pub_ = nh.advertise<nav_msgs::Path>("path", 100);
+    timing_pub_ = nh.advertise<msckf_mono::StageTiming>("stage_timing", 10);
+    if(imu_rate_odom_){
+      imu_odom_pub_ = nh.advertise<nav_msgs::Odometry>("imu_odom", 100);
+    }
     track_image_pub_ = it_.advertise("track_overlay_image", 1);
 
+    filter_thread_ = std::thread(&RosInterface::filter_loop, this);
+
     imu_sub_ = nh_.subscribe("imu", 200, &RosInterface::imuCallback, this);
     image_sub_ = it_.subscribe("image_mono", 20,
                                &RosInterface::imageCallback, this);
     path_.header.frame_id = "map";
   }
 
+  RosInterface::~RosInterface()
+  {
+    {
+      std::lock_guard<std::mutex> lock(frame_mutex_);
+      running_ = false;
+    }
+    frame_ready_.notify_all();
+    frame_space_.notify_all();
+    if(filter_thread_.joinable()){
+      filter_thread_.join();
+    }
+  }
+
   void RosInterface::imuCallback(const sensor_msgs::ImuConstPtr& imu)
   {
     double cur_imu_time = imu->header.stamp.toSec();
     if(prev_imu_time_ == 0.0){
-      prev_imu_time_ = cur_imu_time;
+      // Set before prev_imu_time_ so can_initialize_imu never sees one without the other
       done_stand_still_time_ = cur_imu_time + stand_still_time_;
+      prev_imu_time_ = cur_imu_time;
       return;
     }
 
@@ -42,13 +76,78 @@ namespace msckf_mono
 
     current_imu.dT = cur_imu_time - prev_imu_time_;
 
-    imu_queue_.emplace_back(cur_imu_time, current_imu);
+    const StampedImuReading stamped(cur_imu_time, current_imu);
+    // Only fills up if images stop arriving; the tracker can do without
+    if(!imu_ring_->tryPush(stamped)){
+      gyro_readings_dropped_++;
+      ROS_WARN_STREAM_THROTTLE(1.0, "No images being processed, dropped "
+                               << gyro_readings_dropped_ << " gyro readings so far");
+    }
+    if(imu_calibrated_){
+      size_t num_dropped = filter_imu_queue_->pushDropOldest(stamped);
+      if(num_dropped > 0){
+        imu_readings_dropped_ += num_dropped;
+        ROS_WARN_STREAM_THROTTLE(1.0, "Filter is behind, dropped " << imu_readings_dropped_
+                                 << " IMU readings so far");
+      }
+      if(imu_rate_odom_){
+        propagate_imu_rate(stamped);
+        publish_imu_rate(imu->header.stamp);
+      }
+    }
 
     prev_imu_time_ = cur_imu_time;
   }
 
+  void RosInterface::propagate_imu_rate(const StampedImuReading& stamped)
+  {
+    if(!imu_rate_started_){
+      // The filter starts from the same state and the same first reading
+      imu_rate_state_ = init_imu_state_;
+      imu_rate_started_ = true;
+    }
+
+    imu_rate_readings_.push_back(stamped);
+    // Only grows past this if the filter stops posting corrections
+    if(imu_rate_readings_.size() > static_cast<size_t>(imu_buffer_size_)){
+      imu_rate_readings_.pop_front();
+    }
+
+    const unsigned seq = corrected_seq_.load(std::memory_order_acquire);
+    if(seq == applied_seq_){
+      imu_rate_state_ = MSCKF<float>::propagateNominal(imu_rate_state_, std::get<1>(stamped));
+      return;
+    }
+
+    double corrected_time;
+    {
+      std::lock_guard<std::mutex> lock(corrected_mutex_);
+      imu_rate_state_ = corrected_state_;
+      corrected_time = corrected_time_;
+      applied_seq_ = corrected_seq_;
+    }
+
+    // The filter has propagated everything up to its frame; replay the rest
+    while(!imu_rate_readings_.empty() &&
+          std::get<0>(imu_rate_readings_.front()) <= corrected_time){
+      imu_rate_readings_.pop_front();
+    }
+    for(const auto& x : imu_rate_readings_){
+      imu_rate_state_ = MSCKF<float>::propagateNominal(imu_rate_state_, std::get<1>(x));
+    }
+  }
+
+  void RosInterface::post_corrected_state(double time)
+  {
+    std::lock_guard<std::mutex> lock(corrected_mutex_);
+    corrected_state_ = msckf_.getImuState();
+    corrected_time_ = time;
+    corrected_seq_.fetch_add(1, std::memory_order_release);
+  }
+
   void RosInterface::imageCallback(const sensor_msgs::ImageConstPtr& msg)
   {
+    ros::WallTime received = ros::WallTime::now();
     double cur_image_time = msg->header.stamp.toSec();
     cv_bridge::CvImagePtr cv_ptr;
     try
@@ -62,15 +161,17 @@ namespace msckf_mono
     }
 
     if(!imu_calibrated_){
-      if(imu_queue_.size() % 100 == 0){
-        ROS_INFO_STREAM("Has " << imu_queue_.size() << " readings");
+      imu_ring_->popAll([&](const StampedImuReading& x){
+          calibration_readings_.push_back(std::get<1>(x));});
+      if(calibration_readings_.size() % 100 == 0){
+        ROS_INFO_STREAM("Has " << calibration_readings_.size() << " readings");
       }
 
       if(can_initialize_imu()){
         initialize_imu();
 
         imu_calibrated_ = true;
-        imu_queue_.clear();
+        calibration_readings_.clear();
 
         setup_msckf();
       }
@@ -78,55 +179,119 @@ namespace msckf_mono
       return;
     }
 
-    std::vector<imuReading<float>> imu_since_prev_img;
-    imu_since_prev_img.reserve(10);
+    // readings up to this image, leaving those that belong to the next
+    imu_ring_->popWhile(
+        [&](const StampedImuReading& x){return std::get<0>(x) <= cur_image_time;},
+        [&](const StampedImuReading& x){
+          const auto& reading = std::get<1>(x);
+          Vector3<float> gyro_measurement = R_imu_cam_ * (reading.omega - init_imu_state_.b_g);
+          track_handler_->add_gyro_reading(gyro_measurement);
+        });
 
-    // get the first imu reading that belongs to the next image
-    auto frame_end = std::find_if(imu_queue_.begin(), imu_queue_.end(),
-        [&](const auto& x){return std::get<0>(x) > cur_image_time;});
+    track_handler_->set_current_image( cv_ptr->image, cur_image_time );
 
-    std::transform(imu_queue_.begin(), frame_end,
-        std::back_inserter(imu_since_prev_img),
-        [](auto& x){return std::get<1>(x);});
+    FeatureBatch batch;
+    batch.stamp = msg->header.stamp;
+    batch.time = cur_image_time;
+    batch.received = received;
+    track_handler_->tracked_features(batch.cur_features, batch.cur_ids);
+    track_handler_->new_features(batch.new_features, batch.new_ids);
 
-    imu_queue_.erase(imu_queue_.begin(), frame_end);
+    publish_extra(msg->header.stamp);
 
-    for(auto& reading : imu_since_prev_img){
-      msckf_.propagate(reading);
+    enqueue_frame(batch);
+  }
 
-      Vector3<float> gyro_measurement = R_imu_cam_ * (reading.omega - init_imu_state_.b_g);
-      track_handler_->add_gyro_reading(gyro_measurement);
+  void RosInterface::enqueue_frame(FeatureBatch& batch)
+  {
+    batch.enqueued = ros::WallTime::now();
+    if(backpressure_policy_ == DropOldest){
+      size_t num_dropped = frame_queue_->pushDropOldest(std::move(batch));
+      if(num_dropped > 0){
+        frames_dropped_ += num_dropped;
+        ROS_WARN_STREAM_THROTTLE(1.0, "Filter is behind, dropped " << frames_dropped_
+                                 << " frames so far");
+      }
+      // The filter thread checks the queue under frame_mutex_ before it
+      // waits, so passing through the lock here means it either saw this
+      // frame or is already waiting for the notification.
+      { std::lock_guard<std::mutex> lock(frame_mutex_); }
+    }else{
+      // Holds up this subscriber thread, so the subscriber queue drops instead.
+      // The timeout notices ros shutdown, which does not notify frame_space_.
+      std::unique_lock<std::mutex> lock(frame_mutex_);
+      while(!frame_queue_->tryPush(std::move(batch)) && ros::ok() && running_){
+        frame_space_.wait_for(lock, std::chrono::milliseconds(100));
+      }
     }
+    frame_ready_.notify_one();
+  }
 
-    track_handler_->set_current_image( cv_ptr->image, cur_image_time );
+  void RosInterface::filter_loop()
+  {
+    FeatureBatch batch;
+    for(;;){
+      {
+        std::unique_lock<std::mutex> lock(frame_mutex_);
+        frame_ready_.wait(lock, [&]{return !running_ || frame_queue_->tryPop(batch);});
+        if(!running_) return;
+      }
+      frame_space_.notify_one();
+      process_frame(batch);
+    }
+  }
 
-    std::vector<Vector2<float>,
-      Eigen::aligned_allocator<Vector2<float>>> cur_features;
-    corner_detector::IdVector cur_ids;
-    track_handler_->tracked_features(cur_features, cur_ids);
+  void RosInterface::process_frame(FeatureBatch& batch)
+  {
+    ros::WallTime dequeued = ros::WallTime::now();
+
+    imu_since_prev_img_.clear();
+    while(has_next_filter_imu_ || filter_imu_queue_->tryPop(next_filter_imu_)){
+      const double imu_time = std::get<0>(next_filter_imu_);
+      if(imu_time > batch.time){
+        has_next_filter_imu_ = true;
+        break;
+      }
+      has_next_filter_imu_ = false;
+      imuReading<float> reading = std::get<1>(next_filter_imu_);
+      // Spans any readings imuCallback dropped since the last one
+      if(last_filter_imu_time_ > 0.0){
+        reading.dT = imu_time - last_filter_imu_time_;
+      }
+      last_filter_imu_time_ = imu_time;
+      imu_since_prev_img_.push_back(reading);
+    }
 
-    std::vector<Vector2<float>,
-      Eigen::aligned_allocator<Vector2<float>>> new_features;
-    corner_detector::IdVector new_ids;
-    track_handler_->new_features(new_features, new_ids);
+    for(auto& reading : imu_since_prev_img_){
+      msckf_.propagate(reading);
+    }
 
-    msckf_.augmentState(state_k_, (float)cur_image_time);
-    msckf_.update(cur_features, cur_ids);
-    msckf_.addFeatures(new_features, new_ids);
+    msckf_.augmentState(state_k_++, (float)batch.time);
+    msckf_.update(batch.cur_features, batch.cur_ids);
+    msckf_.addFeatures(batch.new_features, batch.new_ids);
     msckf_.marginalize();
     // msckf_.pruneRedundantStates();
     msckf_.pruneEmptyStates();
 
-    publish_core(msg->header.stamp);
-    publish_extra(msg->header.stamp);
+    publish_core(batch.stamp);
+    if(imu_rate_odom_){
+      post_corrected_state(batch.time);
+    }
+
+    ros::WallTime done = ros::WallTime::now();
+    msckf_mono::StageTiming timing_data;
+    timing_data.stages = {"tracking", "queue_wait", "filter", "latency"};
+    timing_data.times = {(batch.enqueued - batch.received).toSec(),
+                         (dequeued - batch.enqueued).toSec(),
+                         (done - dequeued).toSec(),
+                         (done - batch.received).toSec()};
+    timing_pub_.publish(timing_data);
   }
 
-  void RosInterface::publish_core(const ros::Time& publish_time)
+  void RosInterface::fill_odometry(const imuState<float>& imu_state, const ros::Time& stamp,
+                                   nav_msgs::Odometry& odom) const
   {
-    auto imu_state = msckf_.getImuState();
-
-    nav_msgs::Odometry odom;
-    odom.header.stamp = publish_time;
+    odom.header.stamp = stamp;
     odom.header.frame_id = "map";
     odom.twist.twist.linear.x = imu_state.v_I_G[0];
     odom.twist.twist.linear.y = imu_state.v_I_G[1];
@@ -140,7 +305,12 @@ namespace msckf_mono
     odom.pose.pose.orientation.x = q_out.x();
     odom.pose.pose.orientation.y = q_out.y();
     odom.pose.pose.orientation.z = q_out.z();
+  }
 
+  void RosInterface::publish_core(const ros::Time& publish_time)
+  {
+    nav_msgs::Odometry odom;
+    fill_odometry(msckf_.getImuState(), publish_time, odom);
     odom_pub_.publish(odom);
 
     geometry_msgs::PoseStamped pose_stamped;
@@ -150,6 +320,13 @@ namespace msckf_mono
     path_pub_.publish(path_);
   }
 
+  void RosInterface::publish_imu_rate(const ros::Time& publish_time)
+  {
+    nav_msgs::Odometry odom;
+    fill_odometry(imu_rate_state_, publish_time, odom);
+    imu_odom_pub_.publish(odom);
+  }
+
   void RosInterface::publish_extra(const ros::Time& publish_time)
   {
     if(track_image_pub_.getNumSubscribers() > 0){
@@ -165,7 +342,8 @@ namespace msckf_mono
   bool RosInterface::can_initialize_imu()
   {
     if(imu_calibration_method_ == TimedStandStill){
-      return prev_imu_time_ > done_stand_still_time_;
+      const double prev_imu_time = prev_imu_time_;
+      return prev_imu_time > done_stand_still_time_;
     }
 
     return false;
@@ -180,10 +358,7 @@ namespace msckf_mono
     accel_accum.setZero();
     gyro_accum.setZero();
 
-    for(const auto& entry : imu_queue_){
-      auto imu_time = std::get<0>(entry);
-      auto imu_reading = std::get<1>(entry);
-
+    for(const auto& imu_reading : calibration_readings_){
       accel_accum += imu_reading.a;
       gyro_accum += imu_reading.omega;
       num_readings++;
@@ -217,6 +392,8 @@ namespace msckf_mono
   {
     track_handler_.reset( new corner_detector::TrackHandler(K_, dist_coeffs_, distortion_model_) );
     track_handler_->set_grid_size(n_grid_rows_, n_grid_cols_);
+    track_handler_->set_detection_method(detection_method_, detection_threads_);
+    track_handler_->set_scoring_method(scoring_method_);
     track_handler_->set_ransac_threshold(ransac_threshold_);
   }
 
@@ -283,6 +460,15 @@ namespace msckf_mono
     // Feature tracking parameteres
     nh_.param<int>("n_grid_rows", n_grid_rows_, 8);
     nh_.param<int>("n_grid_cols", n_grid_cols_, 8);
+    int detection_method;
+    nh_.param<int>("corner_detection_method", detection_method, 0);
+    detection_method_ = detection_method == 1 ?
+      corner_detector::GridCellDetection : corner_detector::FullImageDetection;
+    nh_.param<int>("detection_threads", detection_threads_, 1);
+    int scoring_method;
+    nh_.param<int>("corner_scoring_method", scoring_method, 0);
+    scoring_method_ = scoring_method == 1 ?
+      corner_detector::IntegralImageScoring : corner_detector::BoxScoring;
 
     float ransac_threshold_;
     nh_.param<float>("ransac_threshold_", ransac_threshold_, 0.000002);
@@ -331,6 +517,19 @@ namespace msckf_mono
     nh_.param<int>("min_track_length", msckf_params_.min_track_length, 3);
     nh_.param<int>("max_cam_states", msckf_params_.max_cam_states, 20);
 
+    int transition_method;
+    nh_.param<int>("imu_transition_method", transition_method, 0);
+    if(transition_method == 1){
+      msckf_params_.transition_method = ClosedForm;
+    }else{
+      msckf_params_.transition_method = MatrixExponential;
+    }
+    nh_.param<int>("num_threads", msckf_params_.num_threads, 1);
+    nh_.param<float>("triangulation_distance_thresh", msckf_params_.triangulation_distance_thresh, 0.005);
+    nh_.param<float>("triangulation_angle_thresh", msckf_params_.triangulation_angle_thresh, 0.005);
+    // The node never reads the pruned states back
+    msckf_params_.keep_pruned_states = false;
+
     // Load calibration time
     int method;
     nh_.param<int>("imu_initialization_method", method, 0);
@@ -339,6 +538,22 @@ namespace msckf_mono
     }
     nh_.param<double>("stand_still_time", stand_still_time_, 8.0);
 
+    // IMU readings buffered per consumer, ~10 s at 200 Hz
+    nh_.param<int>("imu_buffer_size", imu_buffer_size_, 2048);
+
+    // Publish IMU-propagated odometry between camera updates
+    nh_.param<bool>("imu_rate_odom", imu_rate_odom_, false);
+
+    // Tracking -> filter hand-off
+    nh_.param<int>("frame_queue_size", frame_queue_size_, 4);
+    std::string backpressure;
+    nh_.param<std::string>("frame_queue_backpressure", backpressure, "drop_oldest");
+    if(backpressure == "block"){
+      backpressure_policy_ = Block;
+    }else{
+      backpressure_policy_ = DropOldest;
+    }
+
     ROS_INFO_STREAM("Loaded " << kalibr_camera);
     ROS_INFO_STREAM("-Intrinsics " << intrinsics[0] << ", "
                                    << intrinsics[1] << ", "
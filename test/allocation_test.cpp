@@ -0,0 +1,196 @@
+/*
+ * Checks that the filter runs allocation free once warmed up: a synthetic
+ * camera moves periodically in front of fixed landmarks and, after two
+ * periods, the per-frame calls (propagate, augmentState, update,
+ * addFeatures, marginalize and both pruning functions) must neither call
+ * operator new nor make Eigen allocate, and MSCKF::getHeapAllocations()
+ * must stay put. Needs the EIGEN_STACK_ALLOCATION_LIMIT set in
+ * CMakeLists.txt. Returns non-zero on failure.
+ */
+
+// Eigen only checks EIGEN_RUNTIME_NO_MALLOC through its assertions
+#undef NDEBUG
+#define EIGEN_RUNTIME_NO_MALLOC
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <vector>
+
+#include <msckf_mono/msckf.h>
+
+namespace {
+  bool counting = false;
+  size_t num_allocations = 0;
+
+  // Allocations by the filter only, the scene is built outside
+  void set_counting(bool on)
+  {
+    counting = on;
+    Eigen::internal::set_is_malloc_allowed(!on);
+  }
+}
+
+void* operator new(std::size_t size)
+{
+  if (counting) num_allocations++;
+  if (void* p = std::malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+namespace msckf_mono {
+
+  template <typename _S>
+    bool run(const char* name)
+    {
+      Camera<_S> camera;
+      camera.f_u = camera.f_v = 400;
+      camera.c_u = 320;
+      camera.c_v = 240;
+      camera.q_CI = Quaternion<_S>::Identity();
+      camera.p_C_I << 0.02, 0.0, 0.01;
+
+      noiseParams<_S> noise_params;
+      noise_params.u_var_prime = noise_params.v_var_prime = std::pow(1.0 / 400, 2);
+      Eigen::Matrix<_S, 12, 1> Q_imu_vars;
+      Q_imu_vars << 1e-5, 1e-5, 1e-5,
+                    3.6733e-5, 3.6733e-5, 3.6733e-5,
+                    1e-3, 1e-3, 1e-3,
+                    7e-4, 7e-4, 7e-4;
+      noise_params.Q_imu = Q_imu_vars.asDiagonal();
+      Eigen::Matrix<_S, 15, 1> imu_covar_vars;
+      imu_covar_vars << 1e-5, 1e-5, 1e-5,
+                        1e-2, 1e-2, 1e-2,
+                        1e-2, 1e-2, 1e-2,
+                        1e-2, 1e-2, 1e-2,
+                        1e-12, 1e-12, 1e-12;
+      noise_params.initial_imu_covar = imu_covar_vars.asDiagonal();
+
+      MSCKFParams<_S> msckf_params;
+      msckf_params.max_gn_cost_norm = std::pow(11.0 / 400, 2);
+      msckf_params.min_rcond = 3e-12;
+      msckf_params.translation_threshold = 0.05;
+      msckf_params.redundancy_angle_thresh = 0.005;
+      msckf_params.redundancy_distance_thresh = 0.05;
+      msckf_params.min_track_length = 3;
+      msckf_params.max_track_length = 1000;
+      msckf_params.max_cam_states = 20;
+      // The pruned state record grows by design
+      msckf_params.keep_pruned_states = false;
+
+      // Camera (IMU z) looking along the world x axis
+      imuState<_S> truth;
+      truth.g << 0, 0, -9.81;
+      truth.b_a.setZero();
+      truth.b_g.setZero();
+      truth.p_I_G.setZero();
+      truth.v_I_G << 0, 0.5, 0;
+      Matrix3<_S> R_GI;
+      R_GI << 0, 0, 1,
+             -1, 0, 0,
+              0, -1, 0;
+      truth.q_IG = Quaternion<_S>(R_GI.transpose());
+
+      MSCKF<_S> msckf;
+      msckf.initialize(camera, noise_params, msckf_params, truth);
+
+      std::mt19937 gen(42);
+      std::uniform_real_distribution<double> uniform(-1, 1);
+      std::normal_distribution<double> noise(0.0, 1.0);
+      std::vector<Vector3<_S>, Eigen::aligned_allocator<Vector3<_S>>> landmarks;
+      for (int i = 0; i < 1500; ++i) {
+        landmarks.push_back(Vector3<_S>(6 + 2 * uniform(gen), 4 * uniform(gen), 3 * uniform(gen)));
+      }
+
+      // Every motion is along or about one axis and integrates to a closed
+      // orbit, so the scene repeats every pi seconds (about 63 frames)
+      const int imu_per_frame = 10;
+      const double dt = 0.005;
+      const int warmup_frames = 130;
+      const int num_frames = 320;
+
+      std::vector<Vector2<_S>, Eigen::aligned_allocator<Vector2<_S>>> measurements, new_features;
+      std::vector<size_t> ids, new_ids;
+      std::vector<char> tracked(landmarks.size(), 0);
+      double t = 0;
+      size_t filter_allocations_at_warmup = 0;
+      for (int frame = 0; frame < num_frames; ++frame) {
+        if (frame == warmup_frames) {
+          filter_allocations_at_warmup = msckf.getHeapAllocations();
+          num_allocations = 0;
+        }
+
+        for (int k = 0; k < imu_per_frame; ++k, t += dt) {
+          const Vector3<_S> a_G(0, -std::sin(2 * t), 0.3 * std::cos(2 * t));
+          imuReading<_S> reading;
+          reading.dT = dt;
+          reading.omega << 0.2 * std::cos(2 * t), 0, 0;
+          reading.a = truth.q_IG.toRotationMatrix() * (a_G - truth.g);
+          truth = MSCKF<_S>::propagateNominal(truth, reading);
+          for (int j = 0; j < 3; ++j) {
+            reading.a[j] += 0.01 * noise(gen);
+            reading.omega[j] += 0.001 * noise(gen);
+          }
+          set_counting(frame >= warmup_frames);
+          msckf.propagate(reading);
+          set_counting(false);
+        }
+
+        const Quaternion<_S> q_CG = camera.q_CI * truth.q_IG;
+        const Vector3<_S> p_C_G = truth.p_I_G + truth.q_IG.inverse() * camera.p_C_I;
+        measurements.clear();
+        ids.clear();
+        new_features.clear();
+        new_ids.clear();
+        for (size_t i = 0; i < landmarks.size(); ++i) {
+          const Vector3<_S> p_f_C = q_CG * (landmarks[i] - p_C_G);
+          Vector2<_S> z = p_f_C.template head<2>() / p_f_C(2);
+          const bool visible = p_f_C(2) > 0.5 && std::abs(z(0)) < 0.8 && std::abs(z(1)) < 0.6;
+          z(0) += 0.5 / 400 * noise(gen);
+          z(1) += 0.5 / 400 * noise(gen);
+          if (visible && tracked[i]) {
+            measurements.push_back(z);
+            ids.push_back(i);
+          } else if (visible && new_features.size() < 30 && (frame * 7 + i) % 5 == 0) {
+            new_features.push_back(z);
+            new_ids.push_back(i);
+            tracked[i] = 1;
+          } else {
+            tracked[i] = 0;
+          }
+        }
+
+        set_counting(frame >= warmup_frames);
+        msckf.augmentState(frame, t);
+        msckf.update(measurements, ids);
+        msckf.addFeatures(new_features, new_ids);
+        msckf.marginalize();
+        msckf.pruneRedundantStates();
+        msckf.pruneEmptyStates();
+        set_counting(false);
+      }
+
+      const size_t filter_allocations = msckf.getHeapAllocations() - filter_allocations_at_warmup;
+      const _S position_error = (msckf.getImuState().p_I_G - truth.p_I_G).norm();
+      const bool ok = num_allocations == 0 && filter_allocations == 0 && position_error < 0.1;
+      std::printf("%-6s %d frames after warm-up | operator new %zu | getHeapAllocations +%zu"
+                  " (%zu total) | %zu cam states | pos err %.4f | %s\n",
+                  name, num_frames - warmup_frames, num_allocations, filter_allocations,
+                  msckf.getHeapAllocations(), msckf.getNumCamStates(),
+                  static_cast<double>(position_error), ok ? "ok" : "FAILED");
+      return ok;
+    }
+
+} // End namespace
+
+int main()
+{
+  bool ok = msckf_mono::run<float>("float");
+  ok = msckf_mono::run<double>("double") && ok;
+  return ok ? 0 : 1;
+}
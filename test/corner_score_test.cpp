@@ -0,0 +1,105 @@
+/*
+ * Checks CornerDetector::integralShiTomasiScore against shiTomasiScore at
+ * every pixel of a real image, with one table over the whole image and with
+ * a table per grid cell laid out as GridCellDetection builds them. Takes the
+ * image path as its argument (CMake passes euroc/MH03.png; any EuRoC frame
+ * works). Returns non-zero on failure.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include <opencv2/imgcodecs.hpp>
+
+#include <msckf_mono/corner_detector.h>
+
+using namespace corner_detector;
+
+namespace {
+  struct ScoreErrors {
+    size_t num_scores = 0;
+    size_t num_failed = 0;
+    float max_abs_err = 0;
+  };
+
+  // A nearly uniform box can round its discriminant below zero in both
+  // scores. NaN never wins a cell, like 0.
+  float clean(float score) { return std::isnan(score) ? 0.0f : score; }
+
+  void compare(CornerDetector& detector, const cv::Mat& image,
+               const CornerDetector::GradientIntegral& integral, const cv::Rect& cell,
+               ScoreErrors& errors)
+  {
+    for (int v = cell.y; v < cell.br().y; v++)
+    {
+      for (int u = cell.x; u < cell.br().x; u++)
+      {
+        const float box = clean(detector.shiTomasiScore(image, u, v));
+        const float integral_score = clean(detector.integralShiTomasiScore(integral, u, v));
+        const float err = std::abs(box - integral_score);
+        errors.max_abs_err = std::max(errors.max_abs_err, err);
+        // shiTomasiScore sums in float and the tables in double. Against a
+        // detection threshold of tens, that rounding stays well below 0.5.
+        if (err > 1e-3f * std::abs(box) + 0.5f)
+          errors.num_failed++;
+        errors.num_scores++;
+      }
+    }
+  }
+
+  bool report(const char* name, const ScoreErrors& errors)
+  {
+    const bool ok = errors.num_failed == 0 && errors.num_scores > 0;
+    std::printf("%-10s %zu scores | max abs err %.3g | %zu out of tolerance | %s\n",
+                name, errors.num_scores, errors.max_abs_err, errors.num_failed,
+                ok ? "ok" : "FAILED");
+    return ok;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    std::fprintf(stderr, "Usage: %s image\n", argv[0]);
+    return 1;
+  }
+  const cv::Mat image = cv::imread(argv[1], cv::IMREAD_GRAYSCALE);
+  if (image.empty())
+  {
+    std::fprintf(stderr, "Could not read %s\n", argv[1]);
+    return 1;
+  }
+
+  CornerDetector detector;
+  CornerDetector::GradientIntegral integral;
+  const cv::Rect full(cv::Point(0, 0), image.size());
+
+  ScoreErrors full_errors;
+  detector.compute_gradient_integral(image, full, integral);
+  compare(detector, image, integral, full, full_errors);
+
+  // Cells and regions as in detect_grid_cells, for the default grid. The
+  // tables reuse the full image table's buffers.
+  const int score_border = 15;
+  const int n_rows = detector.get_n_rows();
+  const int n_cols = detector.get_n_cols();
+  const int grid_width = image.cols / n_cols + 1;
+  const int grid_height = image.rows / n_rows + 1;
+  ScoreErrors cell_errors;
+  for (int k = 0; k < n_rows * n_cols; k++)
+  {
+    const cv::Rect cell = cv::Rect((k % n_cols) * grid_width, (k / n_cols) * grid_height,
+                                   grid_width, grid_height) & full;
+    const cv::Rect region =
+      cv::Rect(cell.x - score_border, cell.y - score_border,
+               cell.width + 2*score_border, cell.height + 2*score_border) & full;
+    detector.compute_gradient_integral(image, region, integral);
+    compare(detector, image, integral, cell, cell_errors);
+  }
+
+  bool ok = report("full image", full_errors);
+  ok = report("per cell", cell_errors) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+/*
+ * Checks the single precision measurement update (choleskyKalmanUpdate)
+ * against the Joseph form in double precision, on filter-sized problems:
+ * the correction and covariance within a tolerance, an exactly symmetric
+ * covariance, and no eigenvalue below -eig_tol relative to its norm.
+ * Returns non-zero on failure.
+ */
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "benchmark_utils.h"
+
+namespace msckf_mono {
+
+  void joseph_update(MatrixX<double>& P, const MatrixX<double>& H, const VectorX<double>& r,
+                     double noise_var, VectorX<double>& delta_x)
+  {
+    MatrixX<double> R_n = noise_var * MatrixX<double>::Identity(H.rows(), H.rows());
+    MatrixX<double> S = H * P * H.transpose() + R_n;
+    MatrixX<double> K = P * H.transpose() * S.ldlt().solve(MatrixX<double>::Identity(S.rows(), S.cols()));
+    delta_x = K * r;
+    MatrixX<double> A = MatrixX<double>::Identity(P.rows(), P.cols()) - K * H;
+    MatrixX<double> P_corrected = A * P * A.transpose() + K * R_n * K.transpose();
+    P = (P_corrected + P_corrected.transpose()) / 2;
+  }
+
+  bool run(size_t num_states, int num_rows, double covar_tol, double dx_tol, double eig_tol)
+  {
+    std::vector<imuReading<float>> readings = make_readings<float>(10, 200.0);
+    MSCKF<float> msckf = make_filter<float>(MatrixExponential);
+    while (msckf.getNumCamStates() < num_states) {
+      for (auto reading : readings) {
+        msckf.propagate(reading);
+      }
+      msckf.augmentState(msckf.getNumCamStates(), 0.0);
+    }
+
+    // As in update_benchmark: load the diagonal for the full-rank P of a
+    // running filter, and a compressed measurement on the camera columns
+    MatrixX<float> P = msckf.getCovar();
+    P.diagonal().array() += 1e-4;
+    const int cols = P.cols();
+    std::mt19937 gen(3);
+    std::normal_distribution<double> noise(0.0, 1.0);
+    MatrixX<float> H = MatrixX<float>::Zero(num_rows, cols);
+    VectorX<float> r(num_rows);
+    for (int i = 0; i < num_rows; ++i) {
+      r(i) = 1e-3 * noise(gen);
+      for (int j = 15; j < cols; ++j) {
+        H(i, j) = noise(gen);
+      }
+    }
+    const float noise_var = 1e-5;
+
+    MatrixX<double> P_ref = P.cast<double>();
+    VectorX<double> dx_ref;
+    joseph_update(P_ref, H.cast<double>(), r.cast<double>(), noise_var, dx_ref);
+
+    VectorX<float> dx(cols);
+    ScratchArena scratch;
+    if (!choleskyKalmanUpdate(P, H, r, noise_var, dx, scratch)) {
+      std::printf("%3zu cam states, %3d rows | update skipped | FAILED\n", num_states, num_rows);
+      return false;
+    }
+
+    const double covar_err = (P.cast<double>() - P_ref).norm() / P_ref.norm();
+    const double dx_err = (dx.cast<double>() - dx_ref).norm() / dx_ref.norm();
+    const double asymmetry = (P - P.transpose()).norm();
+    Eigen::SelfAdjointEigenSolver<MatrixX<double>> eig(P.cast<double>(), Eigen::EigenvaluesOnly);
+    const double min_eig = eig.eigenvalues().minCoeff() / P_ref.norm();
+    const bool pass = covar_err < covar_tol && dx_err < dx_tol &&
+      asymmetry == 0 && min_eig > -eig_tol;
+    std::printf("%3zu cam states, %3d rows | rel covar err %.2e | rel dx err %.2e"
+                " | rel min eigenvalue %.2e | %s\n",
+                num_states, num_rows, covar_err, dx_err, min_eig, pass ? "ok" : "FAILED");
+    return pass;
+  }
+
+} // End namespace
+
+int main(int argc, char** argv)
+{
+  bool pass = true;
+  for (size_t num_states : {10, 20, 30, 50}) {
+    for (int num_rows : {20, 60, 120}) {
+      // measurementUpdate compresses to at most one row per camera column
+      if (num_rows > 6 * static_cast<int>(num_states)) continue;
+      pass = msckf_mono::run(num_states, num_rows, 5e-3, 5e-2, 1e-5) && pass;
+    }
+  }
+  return pass ? 0 : 1;
+}